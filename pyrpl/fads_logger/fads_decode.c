@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "fads_log.h"
+
+// Converts a binary fads_logger log (-b) into the tab separated text format of fads_logger,
+// or prints a statistics file (-t).
+// Usage: fads_decode [LOGFILE], reads stdin without argument.
+
+#define FATAL do { fprintf(stderr, "Error at line %d, file %s (%d) [%s]\n", \
+  __LINE__, __FILE__, errno, strerror(errno)); exit(1); } while(0)
+
+static void print_histogram(const char* name, const uint32_t* histogram, int n_bins,
+                            double first, double bin_size, double factor) {
+    int i;
+    printf("%s histogram:\n", name);
+    for (i = 0; i < n_bins; i++) {
+        if (histogram[i] > 0) {
+            printf("  %12f\t%u\n", (first + i * bin_size) * factor, histogram[i]);
+        }
+    }
+}
+
+static int print_stats(FILE *fp, const struct log_header* header) {
+    struct stats_record stats;
+    // the record is packed, so copy the histograms before passing them around
+    uint32_t intensity_histogram[STATS_INTENSITY_BINS];
+    uint32_t width_histogram[STATS_WIDTH_BINS];
+    int i;
+
+    memcpy(&stats, header, sizeof(*header));
+    if (fread((char*) &stats + sizeof(*header), sizeof(stats) - sizeof(*header), 1, fp) != 1
+            || stats.version != STATS_VERSION || stats.record_size != sizeof(stats)) {
+        fprintf(stderr, "Unsupported statistics file\n");
+        return 1;
+    }
+    printf("sequence\t%" PRIu64 "\n", stats.sequence);
+    printf("time\t%f\n", stats.time);
+    printf("interval\t%f\n", stats.interval);
+    printf("droplets\t%u\n", stats.n_droplets);
+    printf("total droplets\t%" PRIu64 "\n", stats.total_droplets);
+    printf("ids\t%u\t%u\n", stats.first_id, stats.last_id);
+    printf("rate\t%f\n", stats.rate);
+    printf("intensity mean/std/min/max\t%f\t%f\t%f\t%f\n", stats.intensity_mean * stats.intensity_factor,
+           sqrt(stats.intensity_variance) * stats.intensity_factor,
+           stats.intensity_min * stats.intensity_factor, stats.intensity_max * stats.intensity_factor);
+    printf("width mean/std/min/max\t%f\t%f\t%f\t%f\n", stats.width_mean / stats.sample_rate,
+           sqrt(stats.width_variance) / stats.sample_rate,
+           stats.width_min / stats.sample_rate, stats.width_max / stats.sample_rate);
+    for (i = 0; i < STATS_N_CLASSES; i++) {
+        printf("class bit %2d\t%u\t%" PRIu64 "\n", i, stats.class_counts[i], stats.total_class_counts[i]);
+    }
+    memcpy(intensity_histogram, stats.intensity_histogram, sizeof(intensity_histogram));
+    memcpy(width_histogram, stats.width_histogram, sizeof(width_histogram));
+    print_histogram("intensity", intensity_histogram, STATS_INTENSITY_BINS,
+                    stats.intensity_hist_min, stats.intensity_bin_size, stats.intensity_factor);
+    print_histogram("width", width_histogram, STATS_WIDTH_BINS,
+                    0, stats.width_bin_size, 1 / stats.sample_rate);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    FILE *fp = stdin;
+    struct log_header header;
+    struct droplet_record record;
+    char skip[256];
+    uint32_t n = 0;
+    uint64_t last_ticks = 0;
+    int first = 1;
+    int stream;
+
+    if (argc > 1 && (fp = fopen(argv[1], "rb")) == NULL) FATAL;
+
+    memset(&header, 0, sizeof(header));
+    if (fread(&header, sizeof(header), 1, fp) == 1 && memcmp(header.magic, STATS_MAGIC, sizeof(STATS_MAGIC)) == 0) {
+        return print_stats(fp, &header);
+    }
+    if (memcmp(header.magic, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0) {
+        fprintf(stderr, "Not a fads_logger binary log\n");
+        return 1;
+    }
+    // version 1 records are a prefix of the current ones
+    if (header.version < 1 || header.version > LOG_VERSION || header.record_size > sizeof(record)
+            || (header.version == LOG_VERSION && header.record_size != sizeof(record))) {
+        fprintf(stderr, "Unsupported log version %u (record size %u)\n", header.version, header.record_size);
+        return 1;
+    }
+    // newer headers may be longer
+    if (header.header_size > sizeof(header)) {
+        if (header.header_size - sizeof(header) > sizeof(skip)
+                || fread(skip, header.header_size - sizeof(header), 1, fp) != 1) {
+            fprintf(stderr, "Invalid header size %u\n", header.header_size);
+            return 1;
+        }
+    }
+
+    // segment files are preallocated, only the first n_records records are valid
+    stream = header.n_records == (header.version >= 3 ? LOG_STREAM : 0);
+    memset(&record, 0, sizeof(record));
+    while ((stream || n++ < header.n_records) && fread(&record, header.record_size, 1, fp) == 1) {
+        printf("%12u\t%12d\t%f\t%12u\t%f\t%3u\t%12u", record.id, record.intensity,
+               record.intensity * header.intensity_factor, record.width,
+               record.width / header.sample_rate, record.classification, record.time);
+        if (header.version >= 2) {
+            printf("\t%16" PRIu64 "\t%" PRId64 ".%09" PRId64 "\t%12.3f", record.ticks,
+                   record.realtime / 1000000000, record.realtime % 1000000000,
+                   first ? 0.0 : (record.ticks - last_ticks) * TIMER_TICK_NS / 1000);
+            last_ticks = record.ticks;
+            first = 0;
+        }
+        printf("\n");
+    }
+
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return 0;
+}
@@ -0,0 +1,100 @@
+// Binary log format of fads_logger (-b and -o) and its statistics (-t), read by fads_decode.
+// A log_header is followed by one droplet_record per droplet, all in the
+// byte order of the RedPitaya (little endian). n_records is LOG_STREAM if the
+// records simply continue until the end of the file. Version 1 records end
+// after time, version 2 adds the unwrapped and wall-clock timestamps. Before
+// version 3, streams had n_records 0, which is now an empty segment.
+
+#ifndef FADS_LOG_H
+#define FADS_LOG_H
+
+#include <inttypes.h>
+
+#define INTENSITY_MAX_FACTOR 0.002441406
+
+#define SAMPLE_RATE 125000
+//#define SAMPLE_RATE 2
+
+#define LOG_MAGIC "FADSLOG"
+#define LOG_VERSION 3
+#define LOG_STREAM UINT32_MAX
+
+// the FPGA time counter (droplet_record.time) advances every 126 ADC clock cycles
+#define TIMER_TICK_NS 1008.0
+
+struct log_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t n_records;
+    // intensity [V] = intensity * intensity_factor, width [s] = width / sample_rate
+    double intensity_factor;
+    double sample_rate;
+    // comma separated name:type list of the record fields
+    char fields[128];
+} __attribute__((packed));
+
+struct droplet_record {
+    uint32_t id;
+    int32_t intensity;
+    uint32_t width;
+    uint16_t classification;
+    uint16_t reserved;
+    uint32_t time;
+    // time without wrap-arounds, and converted to CLOCK_REALTIME [ns]
+    uint64_t ticks;
+    int64_t realtime;
+} __attribute__((packed));
+
+#define LOG_FIELDS "id:u32,intensity:i32,width:u32,classification:u16,reserved:u16,time:u32,ticks:u64,realtime:i64"
+
+// Summary of the droplets of the last interval, written by fads_logger -t.
+// Intensities and widths are raw values as in droplet_record. class_counts[i]
+// counts the droplets with bit i of the classification set (bit 14: sorted,
+// bit 15: positive). The last histogram bins also count all larger values,
+// the first intensity bin all smaller ones.
+
+#define STATS_MAGIC "FADSSTA"
+#define STATS_VERSION 1
+
+#define STATS_N_CLASSES 16
+#define STATS_INTENSITY_BINS 128
+#define STATS_INTENSITY_MIN (-8192)
+#define STATS_INTENSITY_BIN_SIZE 128
+#define STATS_WIDTH_BINS 128
+#define STATS_WIDTH_BIN_SIZE 8
+
+struct stats_record {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t sequence;
+    // CLOCK_REALTIME at the end of the interval, and its length [s]
+    double time;
+    double interval;
+    double intensity_factor;
+    double sample_rate;
+    uint64_t total_droplets;
+    uint64_t total_class_counts[STATS_N_CLASSES];
+    uint32_t n_droplets;
+    uint32_t class_counts[STATS_N_CLASSES];
+    uint32_t first_id;
+    uint32_t last_id;
+    int32_t intensity_min;
+    int32_t intensity_max;
+    uint32_t width_min;
+    uint32_t width_max;
+    int32_t intensity_hist_min;
+    uint32_t intensity_bin_size;
+    uint32_t width_bin_size;
+    double rate;
+    double intensity_mean;
+    double intensity_variance;
+    double width_mean;
+    double width_variance;
+    uint32_t intensity_histogram[STATS_INTENSITY_BINS];
+    uint32_t width_histogram[STATS_WIDTH_BINS];
+} __attribute__((packed));
+
+#endif
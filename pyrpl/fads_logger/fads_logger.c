@@ -9,9 +9,15 @@
 //#include <termios.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 //#include <stdint.h>
 
+#include "fads_log.h"
+
 
 #define FATAL do { fprintf(stderr, "Error at line %d, file %s (%d) [%s]\n", \
   __LINE__, __FILE__, errno, strerror(errno)); exit(1); } while(0)
@@ -20,114 +26,720 @@
 #define MAP_MASK (MAP_SIZE - 1)
 
 #define N_OUTPUT_PARAMETERS 5
-#define INTENSITY_MAX_FACTOR 0.002441406
 
-#define SAMPLE_RATE 125000
-//#define SAMPLE_RATE 2
+#define ADDRESS_BASE 0x40600000
+#define OUTPUT_OFFSET 0x00000200
+#define ADDRESS_ALIGNMENT 0x4
+
+// polls without new droplets before the logger starts to sleep
+#define SPIN_POLLS 1000
+#define MIN_SLEEP_NS 1000
+#define DEFAULT_MAX_SLEEP_US 100
+
+// output is collected in a large buffer and written at least every FLUSH_INTERVAL_NS
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define FLUSH_INTERVAL_NS 200000000L
+
+// droplets wait here between the acquisition and the writer thread, must be a power of two
+#define QUEUE_LENGTH 65536
+#define WRITER_SLEEP_NS 500000L
+
+// segment files (-o) are rotated when full or after a given time
+#define DEFAULT_SEGMENT_SIZE_MB 64
+#define DEFAULT_SEGMENT_SECONDS 3600
+
+// statistics (-t) are published this often by default
+#define DEFAULT_STATS_INTERVAL_MS 250
+
+// the FPGA time is anchored to the host clocks with the least delayed droplet of every interval,
+// the tick length is estimated once the anchors are at least ANCHOR_BASELINE_NS apart
+#define ANCHOR_INTERVAL_NS 1000000000L
+#define ANCHOR_BASELINE_NS 10000000000LL
 
 // (void*)(-1) is the MAP_FAILED return value of mmap
 void* map_base = (void*)(-1);
 
+volatile sig_atomic_t running = 1;
+atomic_int acquiring = 1;
+
+uint32_t last_id = 0;
+uint64_t n_droplets = 0;
+uint64_t n_lost = 0;
+
+// lock-free single producer (acquisition) single consumer (writer) queue
+struct raw_record {
+    uint32_t output[N_OUTPUT_PARAMETERS];
+    // CLOCK_MONOTONIC when the droplet was read [ns]
+    int64_t host_ns;
+};
+struct raw_record queue[QUEUE_LENGTH];
+atomic_uint queue_head = 0;
+atomic_uint queue_tail = 0;
+uint64_t n_dropped = 0;
+uint32_t queue_high_water = 0;
+long max_sleep_ns = DEFAULT_MAX_SLEEP_US * 1000L;
+int binary_output = 0;
+struct timespec last_flush;
+
+// preallocated, memory-mapped output file, only used by the writer thread
+struct segment {
+    int fd;
+    unsigned int number;
+    void* map;
+    struct log_header* header;
+    struct droplet_record* records;
+    uint32_t max_records;
+    uint32_t first_id;
+    uint32_t last_id;
+    uint32_t first_time;
+    struct timespec opened;
+    // realtime of the first record [ns]
+    int64_t first_realtime;
+};
+const char* segment_prefix = NULL;
+size_t segment_size = DEFAULT_SEGMENT_SIZE_MB << 20;
+long segment_seconds = DEFAULT_SEGMENT_SECONDS;
+struct segment segment = {-1, 0, (void*)(-1)};
+FILE* segment_index = NULL;
+
+// statistics of the current interval, only used by the writer thread
+const char* stats_path = NULL;
+long stats_interval_ns = DEFAULT_STATS_INTERVAL_MS * 1000000L;
+int write_droplets = 1;
+struct stats_record stats;
+struct timespec stats_start;
+
+// reconstruction of the droplet times, only used by the writer thread
+struct anchor {
+    uint64_t ticks;
+    int64_t host_ns;
+};
+struct timing {
+    int started;
+    uint32_t last_id;
+    uint32_t last_time;
+    int64_t last_host_ns;
+    uint64_t ticks;
+    uint64_t last_ticks;
+    double tick_ns;
+    struct anchor first;
+    struct anchor current;
+    // least delayed droplet of the running interval
+    struct anchor candidate;
+    double candidate_delay;
+    int64_t interval_start_ns;
+    int64_t realtime_offset_ns;
+};
+struct timing timing;
+
+// droplets per second of wall-clock time (-R)
+FILE* rate_file = NULL;
+int64_t rate_second = -1;
+uint32_t rate_count = 0;
+double rate_interval_sum = 0;
+double rate_interval_min = 0;
+double rate_interval_max = 0;
+
+static void stop(int signum) {
+    running = 0;
+}
+
+static volatile uint32_t* fads_register(uint32_t offset) {
+    return (volatile uint32_t*)(map_base + ((ADDRESS_BASE + offset) & MAP_MASK));
+}
+
+// reads the result registers, again if the droplet changed in the meantime
+static void read_output(uint32_t* output) {
+    volatile uint32_t* result = fads_register(OUTPUT_OFFSET);
+    int i;
+    do {
+        for ( i = 0; i < N_OUTPUT_PARAMETERS; ++i) {
+            output[i] = result[i];
+        }
+    } while (output[0] != result[0]);
+}
+
+static void flush_output() {
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &last_flush);
+}
+
+static void flush_output_periodically() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - last_flush.tv_sec) * 1000000000L + now.tv_nsec - last_flush.tv_nsec > FLUSH_INTERVAL_NS) {
+        flush_output();
+    }
+}
+
+static void fill_header(struct log_header* header) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+    header->version = LOG_VERSION;
+    header->header_size = sizeof(struct log_header);
+    header->record_size = sizeof(struct droplet_record);
+    header->intensity_factor = INTENSITY_MAX_FACTOR;
+    header->sample_rate = SAMPLE_RATE;
+    strncpy(header->fields, LOG_FIELDS, sizeof(header->fields) - 1);
+}
+
+static void write_header() {
+    struct log_header header;
+    fill_header(&header);
+    header.n_records = LOG_STREAM;
+    fwrite(&header, sizeof(header), 1, stdout);
+}
+
+static void open_segment() {
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s_%06u.fads", segment_prefix, segment.number);
+    if ((segment.fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) FATAL;
+    // allocate all blocks now, such that writing a record never waits for the file system
+    if (posix_fallocate(segment.fd, 0, segment_size) != 0) {
+        if (ftruncate(segment.fd, segment_size) == -1) FATAL;
+    }
+    segment.map = mmap(0, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, segment.fd, 0);
+    if (segment.map == (void *) -1) FATAL;
+    segment.header = segment.map;
+    segment.records = segment.map + sizeof(struct log_header);
+    segment.max_records = (segment_size - sizeof(struct log_header)) / sizeof(struct droplet_record);
+    fill_header(segment.header);
+    clock_gettime(CLOCK_MONOTONIC, &segment.opened);
+}
+
+// shrinks the segment to its records and adds it to the index
+static void close_segment() {
+    uint32_t n_records = segment.header->n_records;
+    char filename[1024];
+    if (munmap(segment.map, segment_size) == -1) FATAL;
+    segment.map = (void*)(-1);
+    if (ftruncate(segment.fd, sizeof(struct log_header) + n_records * sizeof(struct droplet_record)) == -1) FATAL;
+    close(segment.fd);
+    if (n_records > 0) {
+        fprintf(segment_index, "%s_%06u.fads\t%u\t%u\t%u\t%" PRId64 ".%09" PRId64 "\t%u\n", segment_prefix,
+                segment.number, segment.first_id, segment.last_id, segment.first_time,
+                segment.first_realtime / 1000000000, segment.first_realtime % 1000000000, n_records);
+        fflush(segment_index);
+        segment.number++;
+    } else {
+        snprintf(filename, sizeof(filename), "%s_%06u.fads", segment_prefix, segment.number);
+        unlink(filename);
+    }
+}
+
+static void write_segment_record(const struct droplet_record* record) {
+    struct timespec now;
+    uint32_t n = segment.header->n_records;
+    if (n > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (n == segment.max_records || now.tv_sec - segment.opened.tv_sec >= segment_seconds) {
+            close_segment();
+            open_segment();
+            n = 0;
+        }
+    }
+    if (n == 0) {
+        segment.first_id = record->id;
+        segment.first_time = record->time;
+        segment.first_realtime = record->realtime;
+    }
+    segment.last_id = record->id;
+    segment.records[n] = *record;
+    segment.header->n_records = n + 1;
+}
+
+static void reset_stats() {
+    memset(stats.class_counts, 0, sizeof(stats.class_counts));
+    memset(stats.intensity_histogram, 0, sizeof(stats.intensity_histogram));
+    memset(stats.width_histogram, 0, sizeof(stats.width_histogram));
+    stats.n_droplets = 0;
+    stats.first_id = stats.last_id = 0;
+    stats.intensity_min = stats.intensity_max = 0;
+    stats.width_min = stats.width_max = 0;
+    stats.intensity_mean = stats.intensity_variance = 0;
+    stats.width_mean = stats.width_variance = 0;
+    clock_gettime(CLOCK_MONOTONIC, &stats_start);
+}
+
+static void init_stats() {
+    memset(&stats, 0, sizeof(stats));
+    memcpy(stats.magic, STATS_MAGIC, sizeof(STATS_MAGIC));
+    stats.version = STATS_VERSION;
+    stats.record_size = sizeof(stats);
+    stats.intensity_factor = INTENSITY_MAX_FACTOR;
+    stats.sample_rate = SAMPLE_RATE;
+    stats.intensity_hist_min = STATS_INTENSITY_MIN;
+    stats.intensity_bin_size = STATS_INTENSITY_BIN_SIZE;
+    stats.width_bin_size = STATS_WIDTH_BIN_SIZE;
+    reset_stats();
+}
+
+static void update_stats(const uint32_t* output) {
+    int32_t intensity = output[1];
+    uint32_t width = output[2];
+    int64_t bin;
+    double delta;
+    int i;
+
+    if (stats.n_droplets == 0) {
+        stats.first_id = output[0];
+        stats.intensity_min = stats.intensity_max = intensity;
+        stats.width_min = stats.width_max = width;
+    }
+    stats.last_id = output[0];
+    stats.n_droplets++;
+    stats.total_droplets++;
+    if (intensity < stats.intensity_min) stats.intensity_min = intensity;
+    if (intensity > stats.intensity_max) stats.intensity_max = intensity;
+    if (width < stats.width_min) stats.width_min = width;
+    if (width > stats.width_max) stats.width_max = width;
+
+    for (i = 0; i < STATS_N_CLASSES; i++) {
+        if (output[3] & (1 << i)) {
+            stats.class_counts[i]++;
+            stats.total_class_counts[i]++;
+        }
+    }
+
+    bin = ((int64_t) intensity - STATS_INTENSITY_MIN) / STATS_INTENSITY_BIN_SIZE;
+    if (bin < 0) bin = 0;
+    if (bin >= STATS_INTENSITY_BINS) bin = STATS_INTENSITY_BINS - 1;
+    stats.intensity_histogram[bin]++;
+    bin = width / STATS_WIDTH_BIN_SIZE;
+    if (bin >= STATS_WIDTH_BINS) bin = STATS_WIDTH_BINS - 1;
+    stats.width_histogram[bin]++;
+
+    // Welford's algorithm, the variance fields hold the sum of squared deviations until published
+    delta = intensity - stats.intensity_mean;
+    stats.intensity_mean += delta / stats.n_droplets;
+    stats.intensity_variance += delta * (intensity - stats.intensity_mean);
+    delta = width - stats.width_mean;
+    stats.width_mean += delta / stats.n_droplets;
+    stats.width_variance += delta * (width - stats.width_mean);
+}
+
+// replaces the statistics file, such that readers always see a complete record
+static void publish_stats(const struct timespec* now) {
+    char tmp_path[1024];
+    struct timespec realtime;
+    FILE* fp;
+    int written;
+    double m2_intensity = stats.intensity_variance;
+    double m2_width = stats.width_variance;
+
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    stats.sequence++;
+    stats.time = realtime.tv_sec + realtime.tv_nsec * 1e-9;
+    stats.interval = (now->tv_sec - stats_start.tv_sec) + (now->tv_nsec - stats_start.tv_nsec) * 1e-9;
+    stats.rate = stats.interval > 0 ? stats.n_droplets / stats.interval : 0;
+    stats.intensity_variance = stats.n_droplets > 1 ? m2_intensity / (stats.n_droplets - 1) : 0;
+    stats.width_variance = stats.n_droplets > 1 ? m2_width / (stats.n_droplets - 1) : 0;
+
+    // a failed publish must not end the acquisition, the skipped interval shows as a gap in the sequence
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", stats_path);
+    if ((fp = fopen(tmp_path, "wb")) == NULL) {
+        perror("Error opening the statistics file");
+    } else {
+        written = fwrite(&stats, sizeof(stats), 1, fp) == 1;
+        if (fclose(fp) != 0 || !written) {
+            perror("Error writing the statistics file");
+        } else if (rename(tmp_path, stats_path) == -1) {
+            perror("Error replacing the statistics file");
+        }
+    }
+    reset_stats();
+}
+
+static void publish_stats_periodically() {
+    struct timespec now;
+    if (stats_path == NULL) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - stats_start.tv_sec) * 1000000000L + now.tv_nsec - stats_start.tv_nsec >= stats_interval_ns) {
+        publish_stats(&now);
+    }
+}
+
+static int64_t now_ns(clockid_t clock) {
+    struct timespec t;
+    clock_gettime(clock, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void set_anchor(const struct anchor* anchor) {
+    timing.current = *anchor;
+    if (timing.current.host_ns - timing.first.host_ns >= ANCHOR_BASELINE_NS) {
+        timing.tick_ns = (double) (timing.current.host_ns - timing.first.host_ns)
+                         / (timing.current.ticks - timing.first.ticks);
+    }
+    timing.realtime_offset_ns = now_ns(CLOCK_REALTIME) - now_ns(CLOCK_MONOTONIC);
+}
+
+// extends the 32 bit FPGA time to 64 bits and keeps track of the anchors
+static void update_timing(const uint32_t* output, int64_t host_ns) {
+    struct anchor point;
+    double delay;
+
+    if (!timing.started) {
+        timing.started = 1;
+        timing.tick_ns = TIMER_TICK_NS;
+        timing.ticks = output[4];
+        timing.first.ticks = timing.ticks;
+        timing.first.host_ns = host_ns;
+        set_anchor(&timing.first);
+        timing.candidate_delay = -1;
+        timing.interval_start_ns = host_ns;
+    } else if (output[0] < timing.last_id) {
+        // the FPGA was reset, continue with the time that passed on the host
+        timing.ticks += (uint64_t) ((host_ns - timing.last_host_ns) / timing.tick_ns);
+        timing.first.ticks = timing.ticks;
+        timing.first.host_ns = host_ns;
+        set_anchor(&timing.first);
+        timing.candidate_delay = -1;
+        timing.interval_start_ns = host_ns;
+    } else {
+        // droplets are less than one wrap-around (about 72 minutes) apart
+        timing.ticks += (uint32_t) (output[4] - timing.last_time);
+    }
+    timing.last_ticks = timing.ticks;
+    timing.last_id = output[0];
+    timing.last_time = output[4];
+    timing.last_host_ns = host_ns;
+
+    // the host reads every droplet late, so the smallest offset is closest to the truth
+    point.ticks = timing.ticks;
+    point.host_ns = host_ns;
+    delay = host_ns - timing.current.host_ns - (double) (timing.ticks - timing.current.ticks) * timing.tick_ns;
+    if (delay < 0) {
+        // the current anchor was read later than this droplet
+        set_anchor(&point);
+        delay = 0;
+    }
+    if (timing.candidate_delay < 0 || delay < timing.candidate_delay) {
+        timing.candidate = point;
+        timing.candidate_delay = delay;
+    }
+    if (host_ns - timing.interval_start_ns >= ANCHOR_INTERVAL_NS) {
+        set_anchor(&timing.candidate);
+        timing.candidate_delay = -1;
+        timing.interval_start_ns = host_ns;
+    }
+}
+
+static int64_t ticks_to_realtime_ns(uint64_t ticks) {
+    return timing.current.host_ns + (int64_t) (((double) ticks - timing.current.ticks) * timing.tick_ns)
+           + timing.realtime_offset_ns;
+}
+
+static void write_rate() {
+    fprintf(rate_file, "%" PRId64 "\t%u\t%f\t%f\t%f\t%" PRIu64 "\t%f\n", rate_second, rate_count,
+            rate_count > 1 ? rate_interval_sum / (rate_count - 1) : 0.0, rate_interval_min, rate_interval_max,
+            timing.current.ticks, timing.tick_ns);
+    fflush(rate_file);
+}
+
+// counts the droplets per wall-clock second, seconds without droplets are written as well
+static void update_rate(int64_t realtime_ns, double interval_us) {
+    int64_t second = realtime_ns / 1000000000LL;
+    if (rate_second < 0) {
+        rate_second = second;
+    }
+    while (second > rate_second) {
+        write_rate();
+        rate_second++;
+        rate_count = 0;
+    }
+    if (rate_count > 0) {
+        rate_interval_sum += interval_us;
+        if (rate_count == 1 || interval_us < rate_interval_min) rate_interval_min = interval_us;
+        if (rate_count == 1 || interval_us > rate_interval_max) rate_interval_max = interval_us;
+    } else {
+        rate_interval_sum = rate_interval_min = rate_interval_max = 0;
+    }
+    rate_count++;
+}
+
+// writes the seconds that are over, allowing for droplets that are read up to a second late
+static void update_rate_idle() {
+    int64_t second = now_ns(CLOCK_REALTIME) / 1000000000LL - 2;
+    if (rate_second < 0) {
+        return;
+    }
+    while (second >= rate_second) {
+        write_rate();
+        rate_second++;
+        rate_count = 0;
+    }
+}
+
+// called by the acquisition thread for every droplet read from the FPGA
+static void acquire_droplet(const uint32_t* output, int64_t host_ns) {
+    unsigned int head = atomic_load_explicit(&queue_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&queue_tail, memory_order_acquire);
+
+    // droplet ids are consecutive, a gap means that droplets were missed
+    if (n_droplets > 0 && output[0] > last_id + 1) {
+        n_lost += output[0] - last_id - 1;
+    }
+    last_id = output[0];
+    n_droplets++;
+
+    // never wait for the writer, drop the droplet instead
+    if (head - tail == QUEUE_LENGTH) {
+        n_dropped++;
+        return;
+    }
+    memcpy(queue[head % QUEUE_LENGTH].output, output, sizeof(queue[0].output));
+    queue[head % QUEUE_LENGTH].host_ns = host_ns;
+    atomic_store_explicit(&queue_head, head + 1, memory_order_release);
+    if (head + 1 - tail > queue_high_water) {
+        queue_high_water = head + 1 - tail;
+    }
+}
+
+static int dequeue_droplet(uint32_t* output, int64_t* host_ns) {
+    unsigned int tail = atomic_load_explicit(&queue_tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&queue_head, memory_order_acquire);
+    if (head == tail) {
+        return 0;
+    }
+    memcpy(output, queue[tail % QUEUE_LENGTH].output, sizeof(queue[0].output));
+    *host_ns = queue[tail % QUEUE_LENGTH].host_ns;
+    atomic_store_explicit(&queue_tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+static void write_droplet(const uint32_t* output, int64_t host_ns) {
+    double intensity = (int32_t) output[1] * INTENSITY_MAX_FACTOR;
+    double width = (uint32_t) output[2] / (double) SAMPLE_RATE;
+    struct droplet_record record;
+    uint64_t last_ticks = timing.ticks;
+    int first = !timing.started;
+    int64_t realtime;
+    double interval_us;
+
+    update_timing(output, host_ns);
+    realtime = ticks_to_realtime_ns(timing.ticks);
+    interval_us = first ? 0.0 : (timing.ticks - last_ticks) * TIMER_TICK_NS / 1000;
+    if (rate_file != NULL) {
+        update_rate(realtime, interval_us);
+    }
+    if (!write_droplets) {
+        return;
+    }
+
+    if (binary_output || segment_prefix != NULL) {
+        record.id = output[0];
+        record.intensity = output[1];
+        record.width = output[2];
+        record.classification = output[3];
+        record.reserved = 0;
+        record.time = output[4];
+        record.ticks = timing.ticks;
+        record.realtime = realtime;
+        if (segment_prefix != NULL) {
+            write_segment_record(&record);
+        } else {
+            fwrite(&record, sizeof(record), 1, stdout);
+        }
+    } else {
+        printf("%12u\t%12d\t%f\t%12u\t%f\t%3u\t%12u\t%16" PRIu64 "\t%" PRId64 ".%09" PRId64 "\t%12.3f\n",
+               output[0], output[1], intensity, output[2], width, output[3], output[4],
+               timing.ticks, realtime / 1000000000, realtime % 1000000000, interval_us);
+    }
+}
+
+// spins for a while after the last droplet, then sleeps increasingly long
+static void back_off(unsigned int idle_polls) {
+    struct timespec t;
+    long ns = MIN_SLEEP_NS;
+    if (idle_polls <= SPIN_POLLS) {
+        return;
+    }
+    idle_polls -= SPIN_POLLS;
+    while (--idle_polls > 0 && ns < max_sleep_ns) {
+        ns *= 2;
+    }
+    if (ns > max_sleep_ns) {
+        ns = max_sleep_ns;
+    }
+    t.tv_sec = ns / 1000000000L;
+    t.tv_nsec = ns % 1000000000L;
+    nanosleep(&t, NULL);
+}
+
+// logs a droplet whenever the id in the result registers changes
+static void poll_output() {
+    uint32_t output[N_OUTPUT_PARAMETERS];
+    unsigned int idle_polls = 0;
+
+    while (running) {
+        read_output(output);
+        if (last_id != output[0]) {
+            acquire_droplet(output, now_ns(CLOCK_MONOTONIC));
+            idle_polls = 0;
+        } else {
+            back_off(++idle_polls);
+        }
+    }
+}
+
+// converts and writes the queued droplets, such that slow output never stalls the acquisition
+static void* writer(void* arg) {
+    uint32_t output[N_OUTPUT_PARAMETERS];
+    int64_t host_ns;
+    struct timespec t = {0, WRITER_SLEEP_NS};
+    int idle = 0;
+
+    while (1) {
+        if (dequeue_droplet(output, &host_ns)) {
+            if (stats_path != NULL) {
+                update_stats(output);
+            }
+            write_droplet(output, host_ns);
+            if (write_droplets) {
+                flush_output_periodically();
+            }
+            publish_stats_periodically();
+            idle = 0;
+        } else if (!atomic_load(&acquiring)) {
+            break;
+        } else {
+            publish_stats_periodically();
+            if (rate_file != NULL) {
+                update_rate_idle();
+            }
+            // nothing to do, so write out what we have
+            if (!idle) {
+                flush_output();
+            }
+            idle = 1;
+            nanosleep(&t, NULL);
+        }
+    }
+    flush_output();
+    if (rate_file != NULL && rate_second >= 0) {
+        write_rate();
+    }
+    return NULL;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-b] [-s MAX_SLEEP_US] [-o PREFIX [-S SIZE_MB] [-T SECONDS]] [-t STATS_FILE [-i INTERVAL_MS]] [-R RATE_FILE] [-q]\n"
+                    "  -b  write binary records (see fads_log.h and fads_decode) instead of text\n"
+                    "  -s  longest sleep while no droplets arrive, default %d us\n"
+                    "  -o  write binary records to the segment files PREFIX_NNNNNN.fads, indexed in PREFIX.index\n"
+                    "  -S  size of a segment file, default %d MB\n"
+                    "  -T  start a new segment file after this time, default %d s\n"
+                    "  -t  keep a summary of the last interval in STATS_FILE (see fads_log.h and fads_decode)\n"
+                    "  -i  length of the statistics interval, default %d ms\n"
+                    "  -R  append the droplets per wall-clock second to RATE_FILE\n"
+                    "  -q  do not write the droplets, only the statistics and rates\n",
+                    name, DEFAULT_MAX_SLEEP_US, DEFAULT_SEGMENT_SIZE_MB, DEFAULT_SEGMENT_SECONDS,
+                    DEFAULT_STATS_INTERVAL_MS);
+    exit(1);
+}
+
 int main(int argc, char **argv) {
 //    printf("DEBUG | Starting Logger\n");
     int fd = -1;
     int ret_val = 0;
+    int opt;
+    pthread_t writer_thread;
 
-
-//    uint32_t address_base =   0x40600110;
-    uint32_t address_base =   0x40600000;
-    uint32_t output_offset =  0x00000200;
-//    uint32_t output_offset =  0x00000300;
-//    uint32_t address_base =   0x40110000;
-//    uint32_t buffer_offset =  0x00010000;
-//    uint32_t wp_address =     0x1000;
-//    uint32_t buf_tail = 0x0;
-//    uint32_t address;
-
-    uint32_t output[N_OUTPUT_PARAMETERS];
-    double intensity;
-    double width;
-    uint32_t last_id = 0;
-    uint32_t address_alignment = 0x4;
-//    uint32_t buffer_length = 0x10;
-//    uint32_t n_buffer_filled;
+    while ((opt = getopt(argc, argv, "bs:o:S:T:t:i:R:q")) != -1) {
+        switch (opt) {
+        case 'b':
+            binary_output = 1;
+            break;
+        case 's':
+            max_sleep_ns = atol(optarg) * 1000L;
+            break;
+        case 'o':
+            segment_prefix = optarg;
+            break;
+        case 'S':
+            segment_size = (size_t) atol(optarg) << 20;
+            break;
+        case 'T':
+            segment_seconds = atol(optarg);
+            break;
+        case 't':
+            stats_path = optarg;
+            break;
+        case 'i':
+            stats_interval_ns = atol(optarg) * 1000000L;
+            break;
+        case 'R':
+            if ((rate_file = fopen(optarg, "a")) == NULL) FATAL;
+            fprintf(rate_file, "# second\tdroplets\tmean_interval_us\tmin_interval_us\tmax_interval_us\tanchor_ticks\ttick_ns\n");
+            break;
+        case 'q':
+            write_droplets = 0;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
     if((fd = open("/dev/mem", O_RDONLY)) == -1) FATAL;
 //    printf("DEBUG | Mapping Memory\n");
-    map_base = mmap(0, MAP_SIZE, PROT_READ, MAP_SHARED, fd, address_base & ~MAP_MASK);
+    map_base = mmap(0, MAP_SIZE, PROT_READ, MAP_SHARED, fd, ADDRESS_BASE & ~MAP_MASK);
     if(map_base == (void *) -1) FATAL;
 
-    int i;
 //    printf("DEBUG | Memory Mapped\n");
 
-//    FILE *fp;
-//    fp = fopen("test.log", "w");
-//    printf("DEBUG | Starting Logging\n");
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
 
-    while (1==1) {
-        for ( i = 0; i < N_OUTPUT_PARAMETERS; ++i) {
-            void* virt_addr = map_base + ((address_base + output_offset + (i * address_alignment)) & MAP_MASK);
-            output[i] = *((volatile uint32_t *) virt_addr);
-//            printf("DEBUG | %d %" PRIu32 "\n", i, output[i]);
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    if (segment_prefix != NULL) {
+        char filename[1024];
+        if (segment_size < sizeof(struct log_header) + sizeof(struct droplet_record)) usage(argv[0]);
+        snprintf(filename, sizeof(filename), "%s.index", segment_prefix);
+        if ((segment_index = fopen(filename, "a")) == NULL) FATAL;
+        if (ftell(segment_index) == 0) {
+            fprintf(segment_index, "# segment\tfirst_id\tlast_id\tfirst_time\tfirst_realtime\tn_records\n");
         }
-
-        intensity = (int32_t) output[1] * INTENSITY_MAX_FACTOR;
-        width = (uint32_t) output[2] / (double) SAMPLE_RATE;
-
-        if (last_id != output[0]) {
-//            fprintf(fp, "%12u\t%12f\t%12d\n", output[0], (double) (output[1] * INTENSITY_MAX_FACTOR) / , output[2]);
-            printf("%12u\t%12d\t%f\t%12u\t%f\t%3u\t%12u\n", output[0], output[1], intensity, output[2], width, output[3], output[4]);
-//            printf("%12u\t%12d\t%12u\t%3u\t%12u\t%12u\n", output[0], output[1], output[2], output[3], output[4], output[5]);
-//            printf("DEBUG | ID %" PRIu32 "\tIntensity %" PRIu32 "\tWidth %" PRIu32 "\tClassification %" PRIu32 "\tTime %" PRIu32 "\n", output[0]);
-//            printf("DEBUG | ID %\tIntensity %\tWidth %\tClassification %\tTime %" PRIu32 PRIu32 PRIu32 PRIu32 PRIu32 "\n", output[0]);
-//            printf("DEBUG | TIME %" PRIu32 "\n", output[4]);
+        // continue the numbering of an existing index
+        struct stat st;
+        while (snprintf(filename, sizeof(filename), "%s_%06u.fads", segment_prefix, segment.number),
+               stat(filename, &st) == 0) {
+            segment.number++;
         }
+        open_segment();
+    } else if (binary_output) {
+        write_header();
+    }
+    flush_output();
+    init_stats();
+    if (pthread_create(&writer_thread, NULL, writer, NULL) != 0) FATAL;
 
-        last_id = output[0];
-
-
-//        // Get current write pointer from FPGA
-//        void* wp_virt_address = map_base + ((address_base + wp_address) & MAP_MASK);
-//        uint32_t buf_head = 0;
-//        buf_head = *((uint32_t *) wp_virt_address);
-//
-////        printf("ADDR: 0x%08x -> 0x%08x\n", wp_address, buf_head);
-//
-//        // Calculate buffer fill status
-//        n_buffer_filled = buf_head - buf_tail + buffer_length - 1;
-//
-//        // Only check if reader (tail) caught up to writer (head, FPGA)
-//        if (buf_head - buf_tail != 0) {
-////        if (n_buffer_filled > 1) {
-////        if (1 == 1) {
-//
-//            // Increment tail address (with wrap modulo for ring buffer)
-//            buf_tail = (buf_tail + 1) % buffer_length;
-//
-//            // Build address from tail index and read out memory location
-//            address = address_base + buffer_offset + (buf_tail * address_alignment);
-//            void* virt_addr = map_base + (address & MAP_MASK);
-//            uint32_t buf_read_result = 0;
-//            buf_read_result = *((uint32_t *) virt_addr);
-//            printf("BUF: 0x%08x Head: 0x%08x Tail: 0x%08x CUR ADDR: 0x%08x -> 0x%08x\n", n_buffer_filled, buf_head, buf_tail, address, buf_read_result);
-//        }
-
-
-        fflush(stdout);
-	}
+    poll_output();
+    atomic_store(&acquiring, 0);
+    pthread_join(writer_thread, NULL);
+    if (stats_path != NULL) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        publish_stats(&now);
+    }
+    if (segment_prefix != NULL) {
+        close_segment();
+        fclose(segment_index);
+    }
+    if (rate_file != NULL) {
+        fclose(rate_file);
+    }
+    fprintf(stderr, "%" PRIu64 " droplets acquired, %" PRIu64 " droplets missed, %" PRIu64
+            " droplets dropped by the full queue, queue high-water mark %u of %u\n",
+            n_droplets, n_lost, n_dropped, queue_high_water, QUEUE_LENGTH);
 
     if (map_base != (void*)(-1)) {
 		if(munmap(map_base, MAP_SIZE) == -1) FATAL;
 		map_base = (void*)(-1);
 	}
 
-	if (map_base != (void*)(-1)) {
-		if(munmap(map_base, MAP_SIZE) == -1) FATAL;
-	}
-
-//	if (fp != -1) {
-//	    close(fp);
-//	}
 	if (fd != -1) {
 		close(fd);
 	}
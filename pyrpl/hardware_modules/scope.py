@@ -401,6 +401,14 @@ class Scope(HardwareModule, AcquisitionModule):
         x[x >= 2 ** 13] -= 2 ** 14
         return x * 20
 
+    @property
+    def _rawdata(self):
+        """raw data from both channels, in a single request if the server
+        supports it (see MonitorClient.scope_data)"""
+        x = np.array(self._client.scope_data(self.data_length), dtype=np.int16)
+        x[x >= 2 ** 13] -= 2 ** 14
+        return x * 20
+
     @property
     def _data_ch1(self):
         """ acquired (normalized) data from ch1"""
@@ -484,7 +492,11 @@ class Scope(HardwareModule, AcquisitionModule):
         """
         Simply pack together channel 1 and channel 2 curves in a numpy array
         """
-        return np.array((self._get_ch(1), self._get_ch(2)))
+        return np.array(
+            np.roll(self._rawdata, - (self._write_pointer_trigger +
+                                      self._trigger_delay_register + 1),
+                    axis=1),
+            dtype=np.float) / 2 ** 13
 
     def _remaining_time(self):
         """
@@ -536,6 +548,28 @@ class Scope(HardwareModule, AcquisitionModule):
         self._autosave_active = autosave_backup
         self._last_time_setup = time()
 
+    def average_traces(self, n_traces, points=None, envelope=False):
+        """
+        Acquires n_traces curves with the current settings and averages them
+        on the board, such that only the result is transferred.
+
+        points:   number of points per channel, dividing data_length (default
+                  data_length), each point is the mean of consecutive samples
+        envelope: also return the smallest and largest sample of each point
+
+        Returns (mean, minima, maxima), arrays of shape (2, points) in the
+        units of the curves. minima and maxima are None without envelope.
+        """
+        # sets the trigger delay for the trigger source, the server re-arms
+        self._start_acquisition()
+        n, mean, minima, maxima = self._client.average_traces(
+            n_traces, points or self.data_length, envelope=envelope,
+            trigger_source=self._trigger_sources[self.trigger_source])
+        norm = 20. / 2 ** 13
+        if not envelope:
+            return mean * norm, None, None
+        return mean * norm, minima * norm, maxima * norm
+
     # Rolling_mode related methods:
     # -----------------------------
 
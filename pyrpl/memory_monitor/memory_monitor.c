@@ -9,7 +9,11 @@
 //#include <termios.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sched.h>
 
 
 #define FATAL do { fprintf(stderr, "Error at line %d, file %s (%d) [%s]\n", \
@@ -18,35 +22,414 @@
 #define MAP_SIZE 4096UL
 #define MAP_MASK (MAP_SIZE - 1)
 
-void* map_base = (void*)(-1);
+#define DEFAULT_ADDRESS 0x40600000
+#define MAX_ADDRESSES 64
+
+// the sampling loop sleeps until SPIN_NS before the deadline and spins for the rest
+#define SPIN_NS 100000L
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+// binary output (-b): a header, then per sample the CLOCK_MONOTONIC time [ns]
+// followed by one word per address, all little endian
+#define BINARY_MAGIC "MEMMON1"
+struct binary_header {
+    char magic[8];
+    uint32_t n_addresses;
+    uint32_t record_size;
+} __attribute__((packed));
+
+// every page holding a monitored register is mapped once
+struct page {
+    unsigned long base;
+    void* map;
+};
+struct page pages[MAX_ADDRESSES];
+int n_pages = 0;
+
+unsigned long addresses[MAX_ADDRESSES];
+volatile uint32_t* registers[MAX_ADDRESSES];
+int n_addresses = 0;
+
+int fd = -1;
+volatile sig_atomic_t running = 1;
+
+// sampling schedule and how well it was kept
+int64_t period_ns = 0;
+int64_t deadline;
+uint64_t n_samples = 0;
+int64_t late_max = 0;
+double late_sum = 0;
+uint64_t overruns = 0;
+
+// trigger-and-capture (-t): every sample goes into a circular history, and when
+// the trigger register fulfils the condition, pre_samples samples before and
+// post_samples samples after the trigger sample are written out
+enum condition { CONDITION_NONE, CONDITION_CHANGE, CONDITION_RISE, CONDITION_FALL, CONDITION_MATCH };
+enum condition condition = CONDITION_NONE;
+int trigger_index = -1;
+uint32_t trigger_mask = 0xffffffff;
+int32_t trigger_level = 0;
+uint32_t pre_samples = 100;
+uint32_t post_samples = 100;
+
+// binary captures start with this, followed by n_samples records
+struct capture_header {
+    uint32_t n_samples;
+    uint32_t trigger_sample;
+} __attribute__((packed));
+
+static void stop(int signum) {
+    running = 0;
+}
+
+static volatile uint32_t* map_address(unsigned long address) {
+    unsigned long base = address & ~MAP_MASK;
+    int i;
+    for (i = 0; i < n_pages; i++) {
+        if (pages[i].base == base) {
+            return (volatile uint32_t*)(pages[i].map + (address & MAP_MASK));
+        }
+    }
+    pages[n_pages].base = base;
+    pages[n_pages].map = mmap(0, MAP_SIZE, PROT_READ, MAP_SHARED, fd, base);
+    if (pages[n_pages].map == (void *) -1) FATAL;
+    return (volatile uint32_t*)(pages[n_pages++].map + (address & MAP_MASK));
+}
+
+static void add_address(const char* arg) {
+    char* end;
+    unsigned long address = strtoul(arg, &end, 0);
+    if (*end != '\0' || (address & 0x3)) {
+        fprintf(stderr, "Invalid address %s\n", arg);
+        exit(1);
+    }
+    if (n_addresses == MAX_ADDRESSES) {
+        fprintf(stderr, "At most %d addresses can be monitored\n", MAX_ADDRESSES);
+        exit(1);
+    }
+    addresses[n_addresses++] = address;
+}
+
+static int64_t timespec_ns(const struct timespec* t) {
+    return t->tv_sec * 1000000000LL + t->tv_nsec;
+}
+
+static int64_t now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return timespec_ns(&t);
+}
+
+static void sleep_until(int64_t deadline) {
+    struct timespec t;
+    int64_t wake = deadline - SPIN_NS;
+    if (wake > now_ns()) {
+        t.tv_sec = wake / 1000000000LL;
+        t.tv_nsec = wake % 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR && running);
+    }
+    while (now_ns() < deadline && running);
+}
+
+// takes the time and then reads every register
+static int64_t read_sample(uint32_t* values) {
+    int64_t t = now_ns();
+    int i;
+    for (i = 0; i < n_addresses; i++) {
+        values[i] = *registers[i];
+    }
+    return t;
+}
+
+// waits for the next deadline (if sampling periodically) and reads a sample, returns 0 when stopped
+static int take_sample(int64_t* t, uint32_t* values) {
+    int64_t late;
+    if (period_ns > 0) {
+        sleep_until(deadline);
+        if (!running) {
+            return 0;
+        }
+    }
+    *t = read_sample(values);
+    n_samples++;
+    if (period_ns > 0) {
+        // how late the sample was taken, whole periods that were missed are skipped
+        late = *t - deadline;
+        late_sum += late;
+        if (late > late_max) {
+            late_max = late;
+        }
+        deadline += period_ns;
+        if (late >= period_ns) {
+            overruns += late / period_ns;
+            deadline += (late / period_ns) * period_ns;
+        }
+    }
+    return running;
+}
+
+static void write_sample(int64_t t, const uint32_t* values, int binary, int timestamps) {
+    int i;
+    if (binary) {
+        fwrite(&t, sizeof(t), 1, stdout);
+        fwrite(values, sizeof(uint32_t), n_addresses, stdout);
+        return;
+    }
+    if (timestamps) {
+        printf("%" PRId64 ".%09" PRId64, (int64_t) (t / 1000000000LL), (int64_t) (t % 1000000000LL));
+    }
+    for (i = 0; i < n_addresses; i++) {
+        printf(timestamps || i > 0 ? "\t0x%08x" : "0x%08x", values[i]);
+    }
+    printf("\n");
+}
+
+static int parse_condition(const char* arg) {
+    char* end;
+    const char* level = strchr(arg, ':');
+    size_t length = level ? (size_t) (level - arg) : strlen(arg);
+    if (length == 6 && strncmp(arg, "change", length) == 0 && !level) {
+        condition = CONDITION_CHANGE;
+        return 0;
+    }
+    if (!level) {
+        return -1;
+    }
+    if (length == 4 && strncmp(arg, "rise", length) == 0) {
+        condition = CONDITION_RISE;
+    } else if (length == 4 && strncmp(arg, "fall", length) == 0) {
+        condition = CONDITION_FALL;
+    } else if (length == 5 && strncmp(arg, "match", length) == 0) {
+        condition = CONDITION_MATCH;
+    } else {
+        return -1;
+    }
+    trigger_level = (int32_t) strtoul(level + 1, &end, 0);
+    return *end == '\0' ? 0 : -1;
+}
+
+// whether the condition became true between the two values of the trigger register
+static int triggered(uint32_t last, uint32_t value) {
+    int32_t a = (int32_t) (last & trigger_mask);
+    int32_t b = (int32_t) (value & trigger_mask);
+    switch (condition) {
+    case CONDITION_CHANGE:
+        return a != b;
+    case CONDITION_RISE:
+        return a < trigger_level && b >= trigger_level;
+    case CONDITION_FALL:
+        return a >= trigger_level && b < trigger_level;
+    case CONDITION_MATCH:
+        return a != (int32_t) (trigger_level & trigger_mask) && b == (int32_t) (trigger_level & trigger_mask);
+    default:
+        return 0;
+    }
+}
+
+// writes up to pre_samples samples before the trigger sample, the trigger sample and the post_samples after it
+static void write_capture(const int64_t* times, const uint32_t* history, uint32_t history_length,
+                          uint64_t first, uint64_t trigger, uint64_t last, uint64_t number, int binary) {
+    struct capture_header header;
+    uint64_t i;
+    if (binary) {
+        header.n_samples = last - first + 1;
+        header.trigger_sample = trigger - first;
+        fwrite(&header, sizeof(header), 1, stdout);
+    } else {
+        printf("# capture %" PRIu64 ", trigger at %" PRId64 ".%09" PRId64 "\n", number,
+               (int64_t) (times[trigger % history_length] / 1000000000LL),
+               (int64_t) (times[trigger % history_length] % 1000000000LL));
+    }
+    for (i = first; i <= last; i++) {
+        write_sample(times[i % history_length], history + (i % history_length) * n_addresses, binary, 1);
+    }
+    fflush(stdout);
+}
+
+// samples into the circular history until count captures were written
+static uint64_t capture(uint64_t count, int binary) {
+    uint32_t history_length = pre_samples + 1 + post_samples;
+    int64_t* times = malloc(history_length * sizeof(int64_t));
+    uint32_t* history = malloc((size_t) history_length * n_addresses * sizeof(uint32_t));
+    uint64_t n = 0;
+    uint64_t trigger = 0;
+    uint64_t first_valid = 0;
+    int armed = 0;
+    int waiting = 0;
+    uint32_t* values;
+    uint32_t last = 0;
+    uint64_t n_captures = 0;
+
+    if (times == NULL || history == NULL) FATAL;
+    while (count == 0 || n_captures < count) {
+        values = history + (n % history_length) * n_addresses;
+        if (!take_sample(&times[n % history_length], values)) {
+            break;
+        }
+        if (!waiting && armed && triggered(last, values[trigger_index])) {
+            trigger = n;
+            if (trigger - first_valid > pre_samples) {
+                first_valid = trigger - pre_samples;
+            }
+            waiting = 1;
+        }
+        if (waiting && n == trigger + post_samples) {
+            write_capture(times, history, history_length, first_valid, trigger, n, n_captures, binary);
+            n_captures++;
+            waiting = 0;
+            // the next pre-trigger window must not overlap with the written samples
+            first_valid = n + 1;
+        }
+        last = values[trigger_index];
+        armed = 1;
+        n++;
+    }
+    free(times);
+    free(history);
+    return n_captures;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-n COUNT] [-p PERIOD_US] [-b] [-r] [-t ADDRESS -c CONDITION [-m MASK] [-B PRE] [-A POST]] [ADDRESS...]\n"
+                    "  reads the registers at the given addresses (default 0x%08x)\n"
+                    "  -n  number of samples (or captures with -t), 0 until interrupted, default 1\n"
+                    "  -p  sample period, free-running without it\n"
+                    "  -b  write binary samples instead of text\n"
+                    "  -r  run with real-time priority\n"
+                    "  -t  trigger register, added to the addresses if not among them\n"
+                    "  -c  trigger condition: change, rise:LEVEL, fall:LEVEL (signed) or match:VALUE\n"
+                    "  -m  mask applied to the trigger register, default 0xffffffff\n"
+                    "  -B  samples kept before the trigger, default %u\n"
+                    "  -A  samples taken after the trigger, default %u\n",
+                    name, DEFAULT_ADDRESS, pre_samples, post_samples);
+    exit(1);
+}
 
 int main(int argc, char **argv) {
-    int fd = -1;
     int ret_val = EXIT_SUCCESS;
+    uint64_t count = 1;
+    uint64_t n_captures = 0;
+    int binary = 0;
+    int realtime = 0;
+    int timestamps;
+    int opt;
+    int i;
+    const char* trigger_address = NULL;
+    uint32_t values[MAX_ADDRESSES];
+    int64_t start, t;
+
+    while ((opt = getopt(argc, argv, "n:p:brt:c:m:B:A:")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = strtoull(optarg, NULL, 0);
+            break;
+        case 'p':
+            period_ns = atol(optarg) * 1000LL;
+            break;
+        case 'b':
+            binary = 1;
+            break;
+        case 'r':
+            realtime = 1;
+            break;
+        case 't':
+            trigger_address = optarg;
+            break;
+        case 'c':
+            if (parse_condition(optarg) == -1) usage(argv[0]);
+            break;
+        case 'm':
+            trigger_mask = strtoul(optarg, NULL, 0);
+            break;
+        case 'B':
+            pre_samples = strtoul(optarg, NULL, 0);
+            break;
+        case 'A':
+            post_samples = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    for (i = optind; i < argc; i++) {
+        add_address(argv[i]);
+    }
+    if (n_addresses == 0) {
+        addresses[n_addresses++] = DEFAULT_ADDRESS;
+    }
+    if ((trigger_address == NULL) != (condition == CONDITION_NONE)) usage(argv[0]);
+    if (trigger_address != NULL) {
+        unsigned long address = strtoul(trigger_address, NULL, 0);
+        for (trigger_index = 0; trigger_index < n_addresses; trigger_index++) {
+            if (addresses[trigger_index] == address) {
+                break;
+            }
+        }
+        if (trigger_index == n_addresses) {
+            add_address(trigger_address);
+        }
+    }
+    // a single text sample is printed as before, without the time
+    timestamps = count != 1;
 
-    unsigned long address = 0x40600000;
     if((fd = open("/dev/mem", O_RDONLY)) == -1) FATAL;
-    map_base = mmap(0, MAP_SIZE, PROT_READ, MAP_SHARED, fd, address & ~MAP_MASK);
-    if(map_base == (void *) -1) FATAL;
-
-    void* virt_addr = map_base + (address & MAP_MASK);
-	uint32_t read_result = 0;
-	read_result = *((uint32_t *) virt_addr);
-	printf("0x%08x\n", read_result);
-	fflush(stdout);
-
-    if (map_base != (void*)(-1)) {
-		if(munmap(map_base, MAP_SIZE) == -1) FATAL;
-		map_base = (void*)(-1);
-	}
-
-	if (map_base != (void*)(-1)) {
-		if(munmap(map_base, MAP_SIZE) == -1) FATAL;
-	}
-	if (fd != -1) {
-		close(fd);
-	}
-
-	return ret_val;
+    for (i = 0; i < n_addresses; i++) {
+        registers[i] = map_address(addresses[i]);
+    }
+
+    if (realtime) {
+        struct sched_param param;
+        param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+        if (sched_setscheduler(0, SCHED_FIFO, &param) == -1) FATAL;
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) FATAL;
+    }
+    // the default timer slack of 50 us would push most wake-ups past the spinning window
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    if (binary) {
+        struct binary_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC));
+        header.n_addresses = n_addresses;
+        header.record_size = sizeof(int64_t) + n_addresses * sizeof(uint32_t);
+        fwrite(&header, sizeof(header), 1, stdout);
+        for (i = 0; i < n_addresses; i++) {
+            uint32_t address = addresses[i];
+            fwrite(&address, sizeof(address), 1, stdout);
+        }
+    }
+
+    start = deadline = now_ns();
+    if (trigger_index >= 0) {
+        n_captures = capture(count, binary);
+    } else {
+        while ((count == 0 || n_samples < count) && take_sample(&t, values)) {
+            write_sample(t, values, binary, timestamps);
+        }
+    }
+    fflush(stdout);
+
+    if (trigger_index >= 0) {
+        fprintf(stderr, "%" PRIu64 " captures\n", n_captures);
+    }
+    if (period_ns > 0 && n_samples > 0) {
+        fprintf(stderr, "%" PRIu64 " samples, mean delay %.3f us, max delay %.3f us, %" PRIu64 " periods skipped\n",
+                n_samples, late_sum / n_samples / 1000, late_max / 1000.0, overruns);
+    } else if (count != 1 && n_samples > 1) {
+        fprintf(stderr, "%" PRIu64 " samples, %.1f samples/s\n", n_samples, n_samples * 1e9 / (now_ns() - start));
+    }
+
+    for (i = 0; i < n_pages; i++) {
+        if(munmap(pages[i].map, MAP_SIZE) == -1) FATAL;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+
+    return ret_val;
 
 }
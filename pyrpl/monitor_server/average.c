@@ -0,0 +1,102 @@
+/*
+###############################################################################
+#    pyrplockbox - DSP servo controller for quantum optics with the RedPitaya
+#    Copyright (C) 2014-2016  Leonhard Neuhaus  (neuhaus@spectro.jussieu.fr)
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+###############################################################################
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "fpga_map.h"
+#include "average.h"
+
+//sign extension of the 14-bit scope samples
+#define SAMPLE(word) (((int32_t)((word) << 18)) >> 18)
+
+//returns NULL if n_points does not divide the trace length or on allocation failure
+struct trace_average* trace_average_open(unsigned int n_points, unsigned int n_channels, int envelope) {
+    struct trace_average* a;
+    if (n_points == 0 || n_points > SCOPE_DATA_LENGTH || SCOPE_DATA_LENGTH % n_points != 0)
+        return NULL;
+    a = calloc(1, sizeof(struct trace_average));
+    if (a == NULL) return NULL;
+    a->n_points = n_points;
+    a->bin_size = SCOPE_DATA_LENGTH / n_points;
+    a->n_channels = n_channels;
+    a->envelope = envelope;
+    a->sums = calloc(n_channels * n_points, sizeof(int64_t));
+    //zero until the first trace, such that a job ended before it sends no stale memory
+    a->minima = calloc(n_channels * n_points, sizeof(int32_t));
+    a->maxima = calloc(n_channels * n_points, sizeof(int32_t));
+    if (a->sums == NULL || a->minima == NULL || a->maxima == NULL) {
+        trace_average_close(a);
+        return NULL;
+    }
+    return a;
+}
+
+void trace_average_close(struct trace_average* a) {
+    if (a == NULL) return;
+    free(a->sums);
+    free(a->minima);
+    free(a->maxima);
+    free(a);
+}
+
+/* Adds the trace of a channel that starts at index first of the circular scope buffer.
+The trace counter is advanced with the last channel. */
+void trace_average_add(struct trace_average* a, unsigned int channel, const uint32_t* buffer, uint32_t first) {
+    int64_t* sums = a->sums + channel * a->n_points;
+    int32_t* minima = a->minima + channel * a->n_points;
+    int32_t* maxima = a->maxima + channel * a->n_points;
+    unsigned int i, j, k = first % SCOPE_DATA_LENGTH;
+    int32_t sample, sum;
+    for (i = 0; i < a->n_points; i++) {
+        sum = 0;
+        for (j = 0; j < a->bin_size; j++) {
+            sample = SAMPLE(buffer[k]);
+            sum += sample;
+            if (a->envelope && ((a->n_traces == 0 && j == 0) || sample < minima[i]))
+                minima[i] = sample;
+            if (a->envelope && ((a->n_traces == 0 && j == 0) || sample > maxima[i]))
+                maxima[i] = sample;
+            k = (k + 1) % SCOPE_DATA_LENGTH;
+        }
+        sums[i] += sum;
+    }
+    if (channel == a->n_channels - 1)
+        a->n_traces++;
+}
+
+//size of the result in 32-bit words
+uint32_t trace_average_words(const struct trace_average* a) {
+    return a->n_channels * a->n_points * (a->envelope ? 4 : 2);
+}
+
+//writes the sums of all channels, followed by the minima and maxima of all channels if enabled
+void trace_average_result(const struct trace_average* a, uint32_t* dest) {
+    unsigned int i;
+    memcpy(dest, a->sums, a->n_channels * a->n_points * sizeof(int64_t));
+    if (!a->envelope) return;
+    dest += 2 * a->n_channels * a->n_points;
+    for (i = 0; i < a->n_channels; i++) {
+        memcpy(dest, a->minima + i * a->n_points, a->n_points * sizeof(int32_t));
+        memcpy(dest + a->n_points, a->maxima + i * a->n_points, a->n_points * sizeof(int32_t));
+        dest += 2 * a->n_points;
+    }
+}
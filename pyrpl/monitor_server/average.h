@@ -0,0 +1,55 @@
+/*
+###############################################################################
+#    pyrplockbox - DSP servo controller for quantum optics with the RedPitaya
+#    Copyright (C) 2014-2016  Leonhard Neuhaus  (neuhaus@spectro.jussieu.fr)
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+###############################################################################
+ */
+
+/*
+Accumulation of scope traces for the trace averaging job of the server.
+
+Every trace of SCOPE_DATA_LENGTH samples is reduced to n_points bins of
+SCOPE_DATA_LENGTH / n_points consecutive samples. Each bin keeps the 64-bit sum
+of its samples over all traces and, if the envelope is enabled, the smallest
+and largest sample. Samples are the 14-bit two's complement values of the scope
+buffers. The mean of a bin is its sum divided by the number of traces times the
+bin size.
+*/
+
+#ifndef AVERAGE_H
+#define AVERAGE_H
+
+#include <stdint.h>
+
+struct trace_average {
+    unsigned int n_points;
+    unsigned int bin_size;
+    unsigned int n_channels;
+    int envelope;
+    uint32_t n_traces;
+    //n_points entries per channel, channel after channel
+    int64_t* sums;
+    int32_t* minima;
+    int32_t* maxima;
+};
+
+struct trace_average* trace_average_open(unsigned int n_points, unsigned int n_channels, int envelope);
+void trace_average_close(struct trace_average* a);
+void trace_average_add(struct trace_average* a, unsigned int channel, const uint32_t* buffer, uint32_t first);
+uint32_t trace_average_words(const struct trace_average* a);
+void trace_average_result(const struct trace_average* a, uint32_t* dest);
+
+#endif
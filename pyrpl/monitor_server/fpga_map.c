@@ -0,0 +1,158 @@
+/*
+###############################################################################
+#    pyrplockbox - DSP servo controller for quantum optics with the RedPitaya
+#    Copyright (C) 2014-2016  Leonhard Neuhaus  (neuhaus@spectro.jussieu.fr)
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+###############################################################################
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
+
+#include "fpga_map.h"
+
+//reserved virtual address range for the whole FPGA region
+static void* map_base = (void*)(-1);
+static int fd = -1;
+//file offsets are physical addresses for /dev/mem, relative ones for regular files
+static int regular_file = 0;
+static int window_mapped[FPGA_N_WINDOWS];
+
+static const struct fpga_backend* backend = NULL;
+
+static void mem_close(void);
+
+static int mem_open(const char *path) {
+    struct stat st;
+    if((fd = open(path, O_RDWR | O_SYNC | O_CREAT, 0644)) == -1) {
+        fprintf(stderr, "Cannot open FPGA memory file %s [%s]\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        mem_close();
+        return -1;
+    }
+    regular_file = S_ISREG(st.st_mode);
+    //only reserve the address range here, windows are mapped on first access
+    map_base = mmap(0, FPGA_REGION_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map_base == (void *) -1) {
+        mem_close();
+        return -1;
+    }
+    memset(window_mapped, 0, sizeof(window_mapped));
+    return 0;
+}
+
+static void mem_close() {
+    if (map_base != (void*)(-1)) {
+        munmap(map_base, FPGA_REGION_SIZE);
+        map_base = (void*)(-1);
+    }
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+static int map_window(unsigned int i) {
+    void* slot = map_base + i * FPGA_WINDOW_SIZE;
+    off_t offset = i * FPGA_WINDOW_SIZE;
+    struct stat st;
+    if (regular_file) {
+        //grow the file such that the whole window is backed
+        if (fstat(fd, &st) == -1) return -1;
+        if (st.st_size < offset + FPGA_WINDOW_SIZE)
+            if (ftruncate(fd, offset + FPGA_WINDOW_SIZE) == -1) return -1;
+    }
+    else
+        offset += FPGA_BASE_ADDR;
+    if (mmap(slot, FPGA_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == (void *) -1)
+        return -1;
+    window_mapped[i] = 1;
+    return 0;
+}
+
+static volatile uint32_t* mem_ptr(uint32_t a_addr, uint32_t a_len) {
+    unsigned int i;
+    if (map_base == (void*)(-1)) return NULL;
+    if (a_addr < FPGA_BASE_ADDR || (a_addr & 0x3)) return NULL;
+    if ((uint64_t)a_addr + 4 * (uint64_t)a_len > FPGA_BASE_ADDR + FPGA_REGION_SIZE) return NULL;
+    a_addr -= FPGA_BASE_ADDR;
+    for (i = a_addr / FPGA_WINDOW_SIZE; i * FPGA_WINDOW_SIZE < a_addr + 4 * a_len; i++) {
+        if (!window_mapped[i] && map_window(i) == -1) {
+            fprintf(stderr, "Cannot map FPGA window 0x%08lx [%s]\n",
+                    FPGA_BASE_ADDR + i * FPGA_WINDOW_SIZE, strerror(errno));
+            return NULL;
+        }
+    }
+    return (volatile uint32_t*)(map_base + a_addr);
+}
+
+const struct fpga_backend fpga_mem_backend = {"mem", FPGA_DEFAULT_PATH, mem_open, mem_close, mem_ptr, NULL};
+
+const struct fpga_backend* fpga_find_backend(const char *name) {
+    if (strcmp(name, fpga_mem_backend.name) == 0) return &fpga_mem_backend;
+    if (strcmp(name, fpga_sim_backend.name) == 0) return &fpga_sim_backend;
+    return NULL;
+}
+
+int fpga_map_open(const struct fpga_backend* a_backend, const char *path) {
+    if (a_backend->open(path) < 0) return -1;
+    backend = a_backend;
+    return 0;
+}
+
+void fpga_map_close() {
+    if (backend != NULL) {
+        backend->close();
+        backend = NULL;
+    }
+}
+
+//returns a pointer to a_len words starting at a_addr, or NULL if that range cannot be accessed
+volatile uint32_t* fpga_map_ptr(uint32_t a_addr, uint32_t a_len) {
+    if (backend == NULL) return NULL;
+    return backend->ptr(a_addr, a_len);
+}
+
+//basic read and write operations, word by word as required by the FPGA bus
+int read_values(uint32_t a_addr, uint32_t* a_values_buffer, uint32_t a_len) {
+    volatile uint32_t* virt_addr = fpga_map_ptr(a_addr, a_len);
+    uint32_t i;
+    if (virt_addr == NULL) return -1;
+    for (i = 0; i < a_len; i++)
+        a_values_buffer[i] = virt_addr[i];
+    return 0;
+}
+
+int write_values(uint32_t a_addr, const uint32_t* a_values, uint32_t a_len) {
+    volatile uint32_t* virt_addr = fpga_map_ptr(a_addr, a_len);
+    uint32_t i;
+    if (virt_addr == NULL) return -1;
+    for (i = 0; i < a_len; i++)
+        virt_addr[i] = a_values[i];
+    if (backend->written != NULL)
+        backend->written(a_addr, a_len);
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+###############################################################################
+#    pyrplockbox - DSP servo controller for quantum optics with the RedPitaya
+#    Copyright (C) 2014-2016  Leonhard Neuhaus  (neuhaus@spectro.jussieu.fr)
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+###############################################################################
+ */
+
+/*
+Mapping manager for the FPGA address space.
+
+The FPGA registers live in 0x40000000 to 0x40800000, one module per 1 MiB
+window (hk, scope, asg, dsp, ams, ..., fads). A contiguous virtual address
+range for the whole region is reserved once when the backing file is opened,
+and every window is mmap'ed into its slot the first time it is accessed. The
+mappings are then kept until fpga_map_close(), such that a request only
+costs the copy itself.
+
+The backing file is /dev/mem on the RedPitaya. Any regular file can be used
+instead (e.g. for testing on a plain linux machine), in which case the file
+offset is the address relative to FPGA_BASE_ADDR and the file is grown to
+the required size on demand.
+
+All accesses go through a backend. The "mem" backend is the mapping described
+above. The "sim" backend (fpga_sim.c) keeps the registers in such a file as
+well, by default in shared memory, and updates the registers of the simulated
+modules whenever they are accessed, such that the server and its clients can
+be tested and benchmarked without a RedPitaya.
+*/
+
+#ifndef FPGA_MAP_H
+#define FPGA_MAP_H
+
+#include <stdint.h>
+
+#define FPGA_DEFAULT_PATH "/dev/mem"
+#define FPGA_BASE_ADDR 0x40000000UL
+#define FPGA_REGION_SIZE 0x00800000UL
+#define FPGA_WINDOW_SIZE 0x00100000UL
+#define FPGA_N_WINDOWS (FPGA_REGION_SIZE / FPGA_WINDOW_SIZE)
+
+//scope module, see hardware_modules/scope.py
+#define SCOPE_ADDR_BASE 0x40100000UL
+#define SCOPE_CH1_OFFSET 0x10000
+#define SCOPE_CH2_OFFSET 0x20000
+#define SCOPE_DATA_LENGTH 16384
+#define SCOPE_ARM 0x0
+#define SCOPE_TRIGGER_SOURCE 0x4
+#define SCOPE_TRIGGER_DELAY 0x10
+#define SCOPE_DECIMATION 0x14
+#define SCOPE_WRITE_POINTER_CURRENT 0x18
+#define SCOPE_WRITE_POINTER_TRIGGER 0x1C
+#define SCOPE_CURRENT_TIMESTAMP 0x15C
+#define SCOPE_TRIGGER_TIMESTAMP 0x164
+
+struct fpga_backend {
+    const char* name;
+    const char* default_path;
+    int (*open)(const char *path);
+    void (*close)(void);
+    //returns a pointer to a_len words at a_addr, or NULL if the range cannot be accessed
+    volatile uint32_t* (*ptr)(uint32_t a_addr, uint32_t a_len);
+    //applies the side effects of writing a_len words at a_addr, may be NULL
+    void (*written)(uint32_t a_addr, uint32_t a_len);
+};
+
+extern const struct fpga_backend fpga_mem_backend;
+extern const struct fpga_backend fpga_sim_backend;
+
+const struct fpga_backend* fpga_find_backend(const char *name);
+int fpga_map_open(const struct fpga_backend* a_backend, const char *path);
+void fpga_map_close(void);
+volatile uint32_t* fpga_map_ptr(uint32_t a_addr, uint32_t a_len);
+
+int read_values(uint32_t a_addr, uint32_t* a_values_buffer, uint32_t a_len);
+int write_values(uint32_t a_addr, const uint32_t* a_values, uint32_t a_len);
+
+#endif
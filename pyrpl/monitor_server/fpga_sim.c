@@ -0,0 +1,267 @@
+/*
+###############################################################################
+#    pyrplockbox - DSP servo controller for quantum optics with the RedPitaya
+#    Copyright (C) 2014-2016  Leonhard Neuhaus  (neuhaus@spectro.jussieu.fr)
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+###############################################################################
+ */
+
+/*
+Simulated FPGA for testing the server and its clients without a RedPitaya.
+
+The registers are kept in a file like with the "mem" backend, by default in
+shared memory. Registers that the FPGA writes itself are updated from the
+time elapsed since the start whenever they are accessed through the server,
+other programs that map the same file see them as of the last access.
+
+Modelled are the scope (timestamp, decimation, arming, trigger delay, write
+pointers and both channel buffers, with a sine on channel 1 and a cosine of
+half the amplitude on channel 2; every trigger source fires right away), the
+FADS droplet outputs at 0x40600200 (droplets at a fixed rate, with a pseudo
+random intensity and width, classified with the thresholds of channel 0), and
+the constant parameter registers of the pid, iq and iir modules. All other
+registers simply keep what was written to them.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "fpga_map.h"
+
+#define SIM_DEFAULT_PATH "/dev/shm/monitor_server_sim"
+#define SIM_CLOCK_HZ 125000000ULL
+
+//the test signal, a 1 kHz sine of half the full range
+#define SIM_SIGNAL_HZ 1000
+#define SIM_TABLE_BITS 10
+#define SIM_AMPLITUDE 4096
+
+#define FADS_ADDR_BASE 0x40600000UL
+#define FADS_RESET 0x20
+#define FADS_OUTPUT 0x200
+#define FADS_MIN_INTENSITY 0x1000
+#define FADS_LOW_INTENSITY 0x1020
+#define FADS_HIGH_INTENSITY 0x1040
+#define SIM_DROPLET_RATE 1000
+
+#define DSP_ADDR_BASE(n) (0x40300000UL + (n)*0x10000UL)
+
+struct constant {
+    uint32_t address;
+    uint32_t value;
+};
+
+//parameters of the bitstream, see the corresponding rtl modules
+#define PID_CONSTANTS(n) {DSP_ADDR_BASE(n) + 0x200, 12}, {DSP_ADDR_BASE(n) + 0x204, 32}, \
+    {DSP_ADDR_BASE(n) + 0x208, 10}, {DSP_ADDR_BASE(n) + 0x20C, 24}, {DSP_ADDR_BASE(n) + 0x220, 4}, \
+    {DSP_ADDR_BASE(n) + 0x224, 5}, {DSP_ADDR_BASE(n) + 0x228, 10}
+#define IQ_CONSTANTS(n) {DSP_ADDR_BASE(n) + 0x200, 11}, {DSP_ADDR_BASE(n) + 0x204, 17}, \
+    {DSP_ADDR_BASE(n) + 0x220, 1}, {DSP_ADDR_BASE(n) + 0x224, 5}, {DSP_ADDR_BASE(n) + 0x228, 50}, \
+    {DSP_ADDR_BASE(n) + 0x230, 4}, {DSP_ADDR_BASE(n) + 0x234, 5}, {DSP_ADDR_BASE(n) + 0x238, 10}
+
+static const struct constant constants[] = {
+    PID_CONSTANTS(0), PID_CONSTANTS(1), PID_CONSTANTS(2),
+    {DSP_ADDR_BASE(4) + 0x200, 32}, {DSP_ADDR_BASE(4) + 0x204, 29}, {DSP_ADDR_BASE(4) + 0x208, 14},
+    IQ_CONSTANTS(5), IQ_CONSTANTS(6), IQ_CONSTANTS(7),
+};
+
+static struct timespec start;
+static int16_t sine[1 << SIM_TABLE_BITS];
+
+static struct {
+    int armed;
+    int triggered;
+    int keep;
+    uint32_t trigger_source;
+    //time up to which the samples have been written, in clock cycles
+    uint64_t cycles;
+    //samples written so far, the write pointer is the index of the next one
+    uint64_t n_samples;
+    //samples still to write after the trigger
+    uint64_t remaining;
+} scope;
+
+static struct {
+    //droplets before the last reset
+    uint64_t offset;
+    uint32_t last_id;
+} fads;
+
+static uint64_t elapsed_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000000000ULL + now.tv_nsec - start.tv_nsec;
+}
+
+static int overlaps(uint32_t a_addr, uint32_t a_len, uint32_t base, uint32_t size) {
+    return (uint64_t)a_addr < (uint64_t)base + size && (uint64_t)a_addr + 4 * (uint64_t)a_len > base;
+}
+
+/* scope */
+
+static volatile uint32_t* scope_regs() {
+    return fpga_mem_backend.ptr(SCOPE_ADDR_BASE, (SCOPE_CH2_OFFSET + 4*SCOPE_DATA_LENGTH) / 4);
+}
+
+//index into the sine table at the time sample k is taken
+static uint32_t scope_phase(uint64_t k, uint32_t decimation) {
+    uint64_t cycles = k * decimation % (SIM_CLOCK_HZ / SIM_SIGNAL_HZ);
+    return cycles * (1 << SIM_TABLE_BITS) / (SIM_CLOCK_HZ / SIM_SIGNAL_HZ);
+}
+
+static void scope_update() {
+    volatile uint32_t* regs = scope_regs();
+    uint64_t now = elapsed_ns() * SIM_CLOCK_HZ / 1000000000ULL;
+    uint32_t decimation, phase, i;
+    uint64_t n, k;
+    if (regs == NULL) return;
+    decimation = regs[SCOPE_DECIMATION/4] & 0x1FFFF;
+    if (decimation == 0)
+        decimation = 1;
+    n = scope.armed ? (now - scope.cycles) / decimation : 0;
+    scope.cycles = scope.armed ? scope.cycles + n * decimation : now;
+    if (scope.armed && scope.trigger_source != 0 && !scope.triggered) {
+        scope.triggered = 1;
+        scope.remaining = regs[SCOPE_TRIGGER_DELAY/4];
+        regs[SCOPE_WRITE_POINTER_TRIGGER/4] = scope.n_samples % SCOPE_DATA_LENGTH;
+        regs[SCOPE_TRIGGER_TIMESTAMP/4] = scope.cycles;
+        regs[SCOPE_TRIGGER_TIMESTAMP/4 + 1] = scope.cycles >> 32;
+    }
+    if (scope.triggered && n > scope.remaining)
+        n = scope.remaining;
+    //only the newest samples are still in the buffer
+    for (k = scope.n_samples + (n > SCOPE_DATA_LENGTH ? n - SCOPE_DATA_LENGTH : 0); k < scope.n_samples + n; k++) {
+        i = k % SCOPE_DATA_LENGTH;
+        phase = scope_phase(k, decimation);
+        regs[SCOPE_CH1_OFFSET/4 + i] = sine[phase] & 0x3FFF;
+        regs[SCOPE_CH2_OFFSET/4 + i] = (sine[(phase + (1 << SIM_TABLE_BITS) / 4) % (1 << SIM_TABLE_BITS)] / 2) & 0x3FFF;
+    }
+    scope.n_samples += n;
+    if (scope.triggered) {
+        scope.remaining -= n;
+        if (scope.remaining == 0) {
+            scope.triggered = 0;
+            scope.trigger_source = 0;
+            scope.armed = scope.keep;
+        }
+    }
+    regs[SCOPE_ARM/4] = scope.armed | (scope.triggered << 2) | (scope.keep << 3);
+    regs[SCOPE_TRIGGER_SOURCE/4] = scope.trigger_source;
+    regs[SCOPE_WRITE_POINTER_CURRENT/4] = (scope.n_samples + SCOPE_DATA_LENGTH - 1) % SCOPE_DATA_LENGTH;
+    regs[SCOPE_CURRENT_TIMESTAMP/4] = now;
+    regs[SCOPE_CURRENT_TIMESTAMP/4 + 1] = now >> 32;
+}
+
+//the registers were brought up to date before the write, such that only the command remains to apply
+static void scope_written(uint32_t a_addr, uint32_t a_len) {
+    volatile uint32_t* regs = scope_regs();
+    uint32_t command;
+    if (regs == NULL) return;
+    if (overlaps(a_addr, a_len, SCOPE_ADDR_BASE + SCOPE_ARM, 4)) {
+        command = regs[SCOPE_ARM/4];
+        scope.keep = (command >> 3) & 0x1;
+        if (command & 0x2) {
+            scope.armed = 0;
+            scope.triggered = 0;
+            scope.trigger_source = 0;
+        }
+        if (command & 0x1) {
+            scope.armed = 1;
+            scope.triggered = 0;
+        }
+    }
+    if (overlaps(a_addr, a_len, SCOPE_ADDR_BASE + SCOPE_TRIGGER_SOURCE, 4))
+        scope.trigger_source = regs[SCOPE_TRIGGER_SOURCE/4] & 0xF;
+    scope_update();
+}
+
+/* fads */
+
+static int32_t sign_extend_14(uint32_t value) {
+    return (int32_t)(value << 18) >> 18;
+}
+
+static void fads_update() {
+    volatile uint32_t* regs = fpga_mem_backend.ptr(FADS_ADDR_BASE, (FADS_HIGH_INTENSITY + 4) / 4);
+    uint64_t count = elapsed_ns() * SIM_DROPLET_RATE / 1000000000ULL;
+    uint32_t id, hash;
+    int32_t intensity;
+    if (regs == NULL) return;
+    if (regs[FADS_RESET/4] & 0x1)
+        fads.offset = count;
+    id = count - fads.offset;
+    if (id != fads.last_id) {
+        fads.last_id = id;
+        hash = id * 2654435761U;
+        intensity = (hash >> 8) % 8192 - 1024;
+        regs[FADS_OUTPUT/4] = id;
+        regs[FADS_OUTPUT/4 + 1] = intensity & 0x3FFF;
+        regs[FADS_OUTPUT/4 + 2] = 20 + (hash >> 24) % 200;
+        regs[FADS_OUTPUT/4 + 3] = (intensity >= sign_extend_14(regs[FADS_MIN_INTENSITY/4]))
+                                | (intensity >= sign_extend_14(regs[FADS_LOW_INTENSITY/4])) << 1
+                                | (intensity >= sign_extend_14(regs[FADS_HIGH_INTENSITY/4])) << 2;
+    }
+    regs[FADS_OUTPUT/4 + 4] = elapsed_ns() / 1000;
+}
+
+/* backend */
+
+static void restore_constants(uint32_t a_addr, uint32_t a_len) {
+    volatile uint32_t* reg;
+    unsigned int i;
+    for (i = 0; i < sizeof(constants) / sizeof(constants[0]); i++)
+        if (overlaps(a_addr, a_len, constants[i].address, 4)
+            && (reg = fpga_mem_backend.ptr(constants[i].address, 1)) != NULL)
+            *reg = constants[i].value;
+}
+
+static int sim_open(const char *path) {
+    unsigned int i;
+    if (fpga_mem_backend.open(path) < 0) return -1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < (1 << SIM_TABLE_BITS); i++)
+        sine[i] = lround(SIM_AMPLITUDE * sin(2 * M_PI * i / (1 << SIM_TABLE_BITS)));
+    memset(&scope, 0, sizeof(scope));
+    memset(&fads, 0, sizeof(fads));
+    fads.last_id = UINT32_MAX;
+    restore_constants(FPGA_BASE_ADDR, FPGA_REGION_SIZE / 4);
+    return 0;
+}
+
+static void sim_close() {
+    fpga_mem_backend.close();
+}
+
+static volatile uint32_t* sim_ptr(uint32_t a_addr, uint32_t a_len) {
+    volatile uint32_t* ptr = fpga_mem_backend.ptr(a_addr, a_len);
+    if (ptr == NULL) return NULL;
+    if (overlaps(a_addr, a_len, SCOPE_ADDR_BASE, FPGA_WINDOW_SIZE))
+        scope_update();
+    if (overlaps(a_addr, a_len, FADS_ADDR_BASE, FPGA_WINDOW_SIZE))
+        fads_update();
+    return ptr;
+}
+
+static void sim_written(uint32_t a_addr, uint32_t a_len) {
+    if (overlaps(a_addr, a_len, SCOPE_ADDR_BASE, FPGA_WINDOW_SIZE))
+        scope_written(a_addr, a_len);
+    restore_constants(a_addr, a_len);
+}
+
+const struct fpga_backend fpga_sim_backend = {"sim", SIM_DEFAULT_PATH, sim_open, sim_close, sim_ptr, sim_written};
@@ -0,0 +1,417 @@
+/*
+###############################################################################
+#    pyrplockbox - DSP servo controller for quantum optics with the RedPitaya
+#    Copyright (C) 2014-2016  Leonhard Neuhaus  (neuhaus@spectro.jussieu.fr)
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+###############################################################################
+ */
+
+/*
+Load generator and latency benchmark for monitor_server.
+
+./monitor_bench [-c CONNECTIONS] [-n REQUESTS | -t SECONDS] [-l WORDS] [-w WRITE_PERCENT]
+                [-q DEPTH] [-a ADDRESS] [-p VERSION [-u]] [HOST] [PORT]
+
+Every connection is driven by its own thread and sends 'r' and 'w' requests of WORDS words at
+ADDRESS, WRITE_PERCENT of them writes, keeping up to DEPTH requests in flight (the server answers
+the requests of a connection in order). The latency of a request is the time from sending it to
+receiving the complete answer. At the end, the throughput and the latency percentiles and
+histogram of all connections are printed.
+
+With -p 2, the connections negotiate protocol version 2 (16-byte headers with request ids, up to
+MAX_TRANSFER words per request). -u then sends the writes without acknowledgement: they do not
+count towards DEPTH and have no latency, and each connection ends with a read that confirms them.
+
+The default address is the scope channel 1 buffer, where the FPGA ignores writes. HOST defaults
+to localhost, PORT to 2222. Run monitor_server with -b sim to benchmark without a RedPitaya.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define MAX_LENGTH 65535
+#define MAX_TRANSFER (1 << 21)
+#define FLAG_NO_ACK 0x80
+#define MAX_DEPTH 64
+#define DEFAULT_ADDRESS 0x40110000U
+#define DEFAULT_PORT "2222"
+
+struct options {
+    const char* host;
+    const char* port;
+    int connections;
+    long requests;
+    double seconds;
+    unsigned int length;
+    int write_percent;
+    int depth;
+    uint32_t address;
+    int version;
+    int no_ack;
+};
+
+struct worker {
+    pthread_t thread;
+    int index;
+    const struct options* options;
+    //latencies of all requests in ns
+    int64_t* latencies;
+    long n_latencies;
+    long size;
+    long reads;
+    long writes;
+    int failed;
+};
+
+static struct options options = {"localhost", DEFAULT_PORT, 1, 10000, 0, 1, 0, 1, DEFAULT_ADDRESS, 1, 0};
+static pthread_barrier_t barrier;
+
+static int64_t now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static int connect_to_server(const struct options* o) {
+    struct addrinfo hints, *result, *ai;
+    int fd = -1, enable = 1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(o->host, o->port, &hints, &result) != 0) {
+        fprintf(stderr, "Cannot resolve %s\n", o->host);
+        return -1;
+    }
+    for (ai = result; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    if (fd < 0) {
+        perror("Cannot connect to the server");
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    return fd;
+}
+
+static int send_all(int fd, const void* data, size_t length) {
+    ssize_t n;
+    while (length > 0) {
+        n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void* data, size_t length) {
+    ssize_t n;
+    while (length > 0) {
+        n = recv(fd, data, length, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int record(struct worker* w, int64_t latency) {
+    int64_t* latencies;
+    if (w->n_latencies == w->size) {
+        w->size = w->size ? 2 * w->size : 65536;
+        latencies = realloc(w->latencies, w->size * sizeof(int64_t));
+        if (latencies == NULL) return -1;
+        w->latencies = latencies;
+    }
+    w->latencies[w->n_latencies++] = latency;
+    return 0;
+}
+
+//writes a request header in the format of the protocol version, returns its size
+static size_t put_header(const struct options* o, unsigned char* header, char command, unsigned char flags,
+                         uint32_t id, uint32_t length) {
+    header[0] = command;
+    header[1] = flags;
+    if (o->version >= 2) {
+        header[2] = header[3] = 0;
+        memcpy(header + 4, &id, 4);
+        memcpy(header + 8, &length, 4);
+        memcpy(header + 12, &o->address, 4);
+        return 16;
+    }
+    header[2] = length & 0xFF;
+    header[3] = (length >> 8) & 0xFF;
+    memcpy(header + 4, &o->address, 4);
+    return 8;
+}
+
+static int negotiate(int fd, int version) {
+    unsigned char header[8] = {'v', version};
+    if (send_all(fd, header, 8) < 0 || recv_all(fd, header, 8) < 0 || header[0] != 'v' || header[1] != version) {
+        fprintf(stderr, "The server does not support protocol version %d\n", version);
+        return -1;
+    }
+    return 0;
+}
+
+static void* run_worker(void* arg) {
+    struct worker* w = arg;
+    const struct options* o = w->options;
+    unsigned char header[16];
+    unsigned char answer[16];
+    size_t size = o->version >= 2 ? 16 : 8;
+    //header and send time of the requests in flight, oldest first
+    unsigned char expected[MAX_DEPTH][16];
+    int64_t sent[MAX_DEPTH];
+    int first = 0, in_flight = 0, unconfirmed = 0;
+    unsigned int seed = w->index + 1;
+    long issued = 0;
+    uint32_t id = 0;
+    int64_t deadline = 0, t;
+    uint32_t* data = calloc(o->length, sizeof(uint32_t));
+    unsigned char* request = malloc(16 + o->length * sizeof(uint32_t));
+    int fd = connect_to_server(o);
+
+    if (fd >= 0 && o->version >= 2 && negotiate(fd, o->version) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    pthread_barrier_wait(&barrier);
+    if (fd < 0 || data == NULL || request == NULL) {
+        w->failed = 1;
+        goto done;
+    }
+    if (o->seconds > 0)
+        deadline = now_ns() + (int64_t)(o->seconds * 1e9);
+    while (1) {
+        //keep the pipeline full until the end of the run
+        while (in_flight < o->depth && (deadline ? now_ns() < deadline : issued < o->requests)) {
+            int write = (int)(rand_r(&seed) % 100) < o->write_percent;
+            int ack = !(write && o->no_ack);
+            put_header(o, request, write ? 'w' : 'r', ack ? 0 : FLAG_NO_ACK, ++id, o->length);
+            if (write)
+                memcpy(request + size, data, o->length * sizeof(uint32_t));
+            if (ack) {
+                memcpy(expected[(first + in_flight) % MAX_DEPTH], request, size);
+                sent[(first + in_flight) % MAX_DEPTH] = now_ns();
+            }
+            if (send_all(fd, request, write ? size + o->length * sizeof(uint32_t) : size) < 0) {
+                perror("Error sending a request");
+                w->failed = 1;
+                goto done;
+            }
+            issued++;
+            if (ack)
+                in_flight++;
+            else {
+                w->writes++;
+                unconfirmed = 1;
+            }
+        }
+        //a final read confirms the writes without acknowledgement, it is not counted
+        if (in_flight == 0 && unconfirmed) {
+            put_header(o, expected[first], 'r', 0, ++id, 1);
+            sent[first] = 0;
+            if (send_all(fd, expected[first], size) < 0) {
+                perror("Error sending a request");
+                w->failed = 1;
+                goto done;
+            }
+            in_flight = 1;
+            unconfirmed = 0;
+        }
+        if (in_flight == 0)
+            break;
+        //the answer echoes the header, a read is followed by its data
+        if (recv_all(fd, answer, size) < 0 || memcmp(answer, expected[first], size) != 0
+            || (answer[0] == 'r' && recv_all(fd, data, (sent[first] ? o->length : 1) * sizeof(uint32_t)) < 0)) {
+            fprintf(stderr, "Connection %d: invalid or missing answer\n", w->index);
+            w->failed = 1;
+            goto done;
+        }
+        t = now_ns();
+        if (sent[first] != 0) {
+            if (record(w, t - sent[first]) < 0) {
+                w->failed = 1;
+                goto done;
+            }
+            if (answer[0] == 'r')
+                w->reads++;
+            else
+                w->writes++;
+        }
+        first = (first + 1) % MAX_DEPTH;
+        in_flight--;
+    }
+done:
+    if (fd >= 0) {
+        send_all(fd, header, put_header(o, header, 'c', 0, ++id, 0));
+        close(fd);
+    }
+    free(data);
+    free(request);
+    return NULL;
+}
+
+static int compare_latencies(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const int64_t* sorted, long n, double p) {
+    long i = (long)(p * (n - 1) + 0.5);
+    return sorted[i] / 1e3;
+}
+
+//one line per power of two of the latency in us, starting at the first non-empty one
+static void print_histogram(const int64_t* sorted, long n) {
+    long i = 0, count;
+    int64_t limit = 1000;
+    while (i < n) {
+        for (count = 0; i < n && sorted[i] < limit; i++)
+            count++;
+        if (i > count || count > 0)
+            printf("  < %8lld us %10ld %6.2f%%\n", (long long)(limit / 1000), count, 100.0 * count / n);
+        limit *= 2;
+    }
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-c CONNECTIONS] [-n REQUESTS | -t SECONDS] [-l WORDS] [-w WRITE_PERCENT]\n"
+                    "       %*s [-q DEPTH] [-a ADDRESS] [-p VERSION [-u]] [HOST] [PORT]\n"
+                    "  -c  number of connections, each driven by a thread, default 1\n"
+                    "  -n  requests per connection, default 10000\n"
+                    "  -t  run for SECONDS instead of a number of requests\n"
+                    "  -l  words per request, 1 to %d (%d with -p 2), default 1\n"
+                    "  -w  percentage of writes, default 0\n"
+                    "  -q  requests in flight per connection, 1 to %d, default 1\n"
+                    "  -a  address, default 0x%08x (scope buffer, writes are ignored)\n"
+                    "  -p  protocol version, 1 or 2, default 1\n"
+                    "  -u  send writes without acknowledgement, requires -p 2\n",
+            name, (int)strlen(name), "", MAX_LENGTH, MAX_TRANSFER, MAX_DEPTH, DEFAULT_ADDRESS);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    struct worker* workers;
+    int64_t* all;
+    long i, n = 0, reads = 0, writes = 0;
+    int64_t start, elapsed;
+    double seconds, words;
+    int opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "c:n:t:l:w:q:a:p:u")) != -1) {
+        switch (opt) {
+        case 'c': options.connections = atoi(optarg); break;
+        case 'n': options.requests = atol(optarg); break;
+        case 't': options.seconds = atof(optarg); break;
+        case 'l': options.length = atoi(optarg); break;
+        case 'w': options.write_percent = atoi(optarg); break;
+        case 'q': options.depth = atoi(optarg); break;
+        case 'a': options.address = strtoul(optarg, NULL, 0); break;
+        case 'p': options.version = atoi(optarg); break;
+        case 'u': options.no_ack = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind < argc) options.host = argv[optind++];
+    if (optind < argc) options.port = argv[optind++];
+    if (optind < argc || options.connections < 1 || options.length < 1 || options.version < 1 || options.version > 2
+        || options.length > (options.version >= 2 ? MAX_TRANSFER : MAX_LENGTH) || (options.no_ack && options.version < 2)
+        || options.depth < 1 || options.depth > MAX_DEPTH || options.write_percent < 0 || options.write_percent > 100)
+        usage(argv[0]);
+
+    workers = calloc(options.connections, sizeof(struct worker));
+    if (workers == NULL) {
+        perror("Error allocating workers");
+        return 1;
+    }
+    pthread_barrier_init(&barrier, NULL, options.connections + 1);
+    for (i = 0; i < options.connections; i++) {
+        workers[i].index = i;
+        workers[i].options = &options;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("Error starting a thread");
+            return 1;
+        }
+    }
+    pthread_barrier_wait(&barrier);
+    start = now_ns();
+    for (i = 0; i < options.connections; i++) {
+        pthread_join(workers[i].thread, NULL);
+        n += workers[i].n_latencies;
+        reads += workers[i].reads;
+        writes += workers[i].writes;
+        failed |= workers[i].failed;
+    }
+    elapsed = now_ns() - start;
+    if (reads + writes == 0) {
+        fprintf(stderr, "No request completed\n");
+        return 1;
+    }
+
+    all = malloc((n + 1) * sizeof(int64_t));
+    if (all == NULL) {
+        perror("Error allocating latencies");
+        return 1;
+    }
+    for (n = 0, i = 0; i < options.connections; i++) {
+        memcpy(all + n, workers[i].latencies, workers[i].n_latencies * sizeof(int64_t));
+        n += workers[i].n_latencies;
+        free(workers[i].latencies);
+    }
+    qsort(all, n, sizeof(int64_t), compare_latencies);
+
+    seconds = elapsed / 1e9;
+    words = (double)(reads + writes) * options.length;
+    printf("%d connections, %u words per request, %d%% writes%s, %d in flight, address 0x%08x, protocol %d\n",
+           options.connections, options.length, options.write_percent, options.no_ack ? " without ack" : "",
+           options.depth, options.address, options.version);
+    printf("%ld requests (%ld reads, %ld writes) in %.3f s\n", reads + writes, reads, writes, seconds);
+    printf("throughput: %.0f requests/s, %.0f words/s, %.2f MB/s\n", (reads + writes) / seconds, words / seconds,
+           words * sizeof(uint32_t) / seconds / 1e6);
+    //writes without acknowledgement have no latency
+    if (n > 0)
+        printf("latency: min %.1f us, p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+               all[0] / 1e3, percentile(all, n, 0.5), percentile(all, n, 0.99), percentile(all, n, 0.999),
+               all[n - 1] / 1e3);
+    print_histogram(all, n);
+    free(all);
+    free(workers);
+    return failed;
+}
@@ -39,7 +39,15 @@ Communication protocol for the data server:
 
 The program is launched on the redpitaya with 
 
-./monitor-server PORT-NUMBER, where the default port number is 2222.  
+./monitor-server [-s] [-b BACKEND] [-d STATS-FILE [-i SECONDS]] PORT-NUMBER [MEMORY-FILE], where the default port number is 2222.  
+
+MEMORY-FILE defaults to /dev/mem. Any regular file can be given instead to run the server without FPGA, 
+e.g. for testing on a linux machine. The FPGA memory is mapped once and kept mapped while the server runs. 
+BACKEND "sim" simulates the scope and FADS modules instead (see fpga_sim.c), MEMORY-FILE then defaults 
+to /dev/shm/monitor_server_sim. The default BACKEND "mem" accesses MEMORY-FILE as it is. 
+With -s, the server keeps a shadow copy of the configuration registers listed in shadow.c. Reads of 'r' and 'b' 
+requests that only cover known configuration registers are then answered without accessing the FPGA. 
+With -d, the statistics of the server (see stats.h) are written to STATS-FILE every SECONDS (default 10). 
 
 We allow for bidirectional data transfer. The client (python program) connects to the server, which in return accepts the connection. 
 The client sends 8 bytes of data:
@@ -50,12 +58,115 @@ Bytes 5-8 are the start address to be written to.
 
 If the command is read, the server will then send the requested 4*n bytes to the client. 
 If the command is write, the server will wait for 4*n bytes of data from the server and write them to the designated FPGA address space. 
-If the command is close, or if the connection is broken, the server program will terminate. 
+If the command is close, or if the connection is broken, the server closes this connection. 
 
 After this, the server will wait for the next command. 
-*/
+Any number of clients can be connected at the same time. Requests of all clients are served one after 
+the other by a single thread, such that the FPGA is never accessed concurrently. A client that sends an 
+invalid request is disconnected, the other clients are not affected. 
+Reads outside of the FPGA address space 0x40000000 to 0x40800000 return zeros, writes there are ignored. 
+
+Batch command 'b' (several reads and writes in one round trip):
+Bytes 3+4 of the header are the number m of entries, bytes 5-8 are ignored. Maximum is MAX_BATCH. 
+The header is followed by m entries of 8 bytes with the same layout as a 'r' or 'w' header, 
+followed by the data of all 'w' entries concatenated in the order of the entries. 
+The entries are executed in order. The server answers with the 8-byte header followed by the data 
+of all 'r' entries concatenated in the order of the entries. 
+The total number of words read and the total number of words written must each not exceed MAX_LENGTH. 
+
+Subscribe command 's' (the server pushes register values periodically): 
+Byte 2 of the header holds flags, bit 0 set means that values are only pushed when they have changed. 
+Bytes 3+4 are the number m of address ranges, maximum is MAX_SUBSCRIPTION_RANGES. 
+Bytes 5-8 are the sampling period in microseconds (minimum MIN_PERIOD_US). 
+The header is followed by m entries of 8 bytes with the layout of a 'r' header. The server acknowledges with 
+the 8-byte header and from then on samples all ranges every period. Each sample is sent as a frame consisting of 
+an 8-byte header ('p', reserved, number of words, sample number) followed by the words of all ranges 
+concatenated in order. The sample number counts all samples, such that missed or unchanged samples can be detected. 
+A new 's' command replaces the previous subscription. The unsubscribe command 'u' stops the frames, the server 
+answers with the 8-byte 'u' header after the last frame. All other commands can still be used while subscribed, 
+but their answers are interleaved with the frames. 
+
+Masked write command 'm' (read-modify-write of bit fields in one round trip): 
+Bytes 3+4 are the number n of words, bytes 5-8 the start address. The header is followed by n pairs of words 
+(mask, value). Word i at the start address is set to (old & ~mask) | (value & mask), where old is its current 
+content. No other request is served in between, such that the update is atomic with respect to all clients. 
+The server answers with the 8-byte header. 
+
+Scope data command 'a' (both scope channel buffers in one response): 
+Byte 2 of the header holds flags, bit 0 set means that samples are packed to 16 bits. 
+Bytes 3+4 are the number n of samples per channel, maximum is SCOPE_DATA_LENGTH. Bytes 5-8 are ignored. 
+The server answers with the 8-byte header followed by the first n words of the channel 1 buffer 
+and the first n words of the channel 2 buffer. If packed, the lower 16 bits of each word are sent instead 
+of the words, i.e. the answer carries 4*n bytes of samples. 
+
+Scope stream command 'o' (gap-free continuous acquisition): 
+The scope must be running continuously, i.e. armed with trigger source 'off' as in rolling mode. 
+Byte 2 of the header holds flags: bit 0 packs samples to 16 bits as for 'a', bits 1 and 2 select 
+channel 1 and channel 2 (none set means both). Bytes 3+4 are ignored, bytes 5-8 are the polling period in 
+microseconds (minimum MIN_PERIOD_US). The server acknowledges with the 8-byte header. Then it polls the scope 
+write pointer every period and sends all samples written since the last poll as a frame consisting of 
+an 8-byte header ('o', flags, number n of samples per channel, frame number), three words 
+(64-bit index of the first sample in the stream, number of overflows so far) and the n samples 
+of each selected channel, padded to a multiple of 4 bytes. The sample index also counts lost samples. 
+If more samples were written than the scope buffer holds, the oldest ones are lost, bit 0 of the 
+flags byte of the frame is set and the overflow counter is incremented. The command 'u' also stops the stream. 
+
+Spectrum stream command 'f' (Welch power spectra of the continuous acquisition, see spectrum.h): 
+The scope must be running continuously as for 'o'. Byte 2 of the header holds flags: bits 1 and 2 select 
+channel 1 and channel 2 (none set means both). Bytes 3+4 are the number N of segments averaged per spectrum (at least 1). 
+Bits 0-3 of bytes 5-8 are the base 2 logarithm of the segment length L (6 to 14), bits 4-7 the window 
+(0 boxcar, 1 hann, 2 hamming, 3 blackman, 4 flattop) and bits 8-31 the polling period in microseconds 
+(minimum MIN_PERIOD_US). The server acknowledges with the header. It polls the scope like for 'o', cuts the 
+samples into segments of L samples overlapping by half and sends a frame every N segments: a header 
+('f', flags, number L/2 + 1 of bins, spectrum number) followed by the L/2 + 1 bins of each selected channel 
+as 32-bit floats. Bit 0 of the flags of the frame is set if samples were lost since the previous frame, 
+segments never span such a gap. Spectra that a slow client cannot take are dropped, which shows in the 
+spectrum number. The command 'u' also stops the spectrum stream. 
 
-/* for now the program is utterly unoptimized... */
+Trace averaging command 't' (the server acquires and accumulates scope traces): 
+The scope must be configured as for a single acquisition (decimation, trigger delay, trigger thresholds). 
+Byte 2 of the header holds flags: bit 0 adds the min/max envelope, bits 1 and 2 select channel 1 and channel 2 
+(none set means both). Bytes 3+4 are the number N of traces. Bits 0-15 of bytes 5-8 are the number P of points 
+per trace, which must divide SCOPE_DATA_LENGTH (0 means SCOPE_DATA_LENGTH), bits 16-19 the trigger source. 
+The server resets and arms the scope with this trigger source N times and sums up the traces, each starting at 
+the trigger delay as in hardware_modules/scope.py. Every point is the sum of SCOPE_DATA_LENGTH / P consecutive 
+samples. When all traces are done, the server answers with the header, holding P in bytes 3+4 and the number of 
+traces summed up in bytes 5-8, followed by the sums as 64-bit signed ints (P per selected channel) and, with the 
+envelope, the smallest and largest sample of every point as 32-bit signed ints (P minima and P maxima per 
+selected channel). Later requests of the connection wait for this answer. A 'u' sent right after the 't' 
+ends the job early with the traces summed up so far, a 'c' cancels it. With N = 0, the answer comes 
+right away with zero sums. 
+
+Statistics command 'q' (request counters and service time histograms, see stats.h): 
+Byte 2 of the header holds flags, bit 0 set resets the statistics after they are sent. The server answers with 
+the header holding the number of words in bytes 3+4 and the number of characters in bytes 5-8, followed by the 
+statistics as text, padded with zeros to a multiple of 4 bytes. 
+
+Snapshot command 'g' and restore command 'l' (configuration of all modules in one round trip): 
+The configuration registers are the ranges listed in shadow.c, the registers of all module windows 
+that read back what was written. 'g' is answered with the header holding the number n of words of all ranges 
+in bytes 3+4 and the layout id of the range table in bytes 5-8, followed by the n words in the order of the table. 
+'l' sends such a snapshot back: bytes 3+4 hold n, bytes 5-8 the layout id, followed by the n words. The server 
+reads the current configuration and only writes the words that differ, consecutive words with a single write. 
+It answers with the header, bytes 5-8 holding the number of words written. A snapshot with another layout id 
+or length is an invalid request, e.g. if it was taken from a server with a different table. 
+
+Protocol version 2 (request ids, 32-bit lengths, optional write acknowledgements): 
+A connection starts with the 8-byte headers described above. The version command 'v' with the requested version 
+in byte 2 (bytes 3-8 zero) is answered with the 8-byte header, byte 2 holding the version the server grants 
+(at most PROTOCOL_VERSION). From then on, all requests, answers and pushed frames of the connection carry 
+16-byte headers: byte 1 command, byte 2 flags, bytes 3+4 zero, bytes 5-8 a request id chosen by the client, 
+bytes 9-12 the number of words (or entries, samples, ...) as a 32-bit unsigned int, bytes 13-16 the address 
+(or period, sample number, ...). All commands keep their meaning, with "bytes 3+4" and "bytes 5-8" of the 
+descriptions above referring to the length and address fields. Entries of 'b' and 's' keep the 8-byte layout. 
+The answer to a request echoes its header including the id, pushed frames carry the id of the 's' or 'o' 
+request that started them. Reads and writes can be up to MAX_TRANSFER words long. Flag bit 7 (FLAG_NO_ACK) of 
+a 'w', 'm' or 'l' request suppresses its answer. 
+Requests are always served in order, so a client can send many requests without waiting for the answers, 
+and an answered request confirms that all earlier requests of the connection have been executed. 
+Servers that do not know 'v' ignore it like every request with a length of 0, so a client first sends a 'v' 
+for version 1 followed by a read. Only servers that support versions answer the 'v' before the read. 
+*/
 
 #define _GNU_SOURCE
 
@@ -69,109 +180,1170 @@ After this, the server will wait for the next command.
 #include <fcntl.h>
 #include <ctype.h>
 #include <sys/types.h>
-#include <sys/mman.h>
 #include <stdint.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
+#include <time.h>
+
+#include "fpga_map.h"
+#include "shadow.h"
+#include "average.h"
+#include "spectrum.h"
+#include "stats.h"
 
 void error(const char *msg);
 
 #define FATAL do { fprintf(stderr,"Error at line %d, file %s (%d) [%s]\n", __LINE__, __FILE__, errno, strerror(errno)); \
 									error("FATAL ERROR"); exit(1); } while(0)
 
-//#define MAP_SIZE 4096UL
-//#define MAP_SIZE 65536UL
-#define MAP_SIZE 131072UL
-//allowed address space: 0x40000000 to 0x40800000 has size 0x800000 = 128*65536 = 8388608
-//#define MAP_SIZE 8388608UL
-#define MAP_MASK (MAP_SIZE - 1)
 #define MAX_LENGTH 65535
+//maximum length of reads and writes in protocol version 2, the whole FPGA region
+#define MAX_TRANSFER (FPGA_REGION_SIZE / 4)
+#define PROTOCOL_VERSION 2
+#define FLAG_NO_ACK 0x80
+#define MAX_BATCH 4096
+#define MAX_SUBSCRIPTION_RANGES 256
+#define MIN_PERIOD_US 100
+
+#define MAX_EVENTS 64
+#define RECV_CHUNK 65536
+//requests of a client are not served while that many bytes wait to be sent to it
+#define MAX_OUTPUT_BACKLOG (4*1024*1024)
 
 #define DEBUG_MONITOR 0
+#define DEFAULT_STATS_INTERVAL 10
+
+//growing byte buffer, the data are between start and end
+struct buffer {
+    unsigned char* data;
+    size_t start;
+    size_t end;
+    size_t size;
+};
 
-unsigned long read_value(unsigned long a_addr);
-unsigned long* read_values(unsigned long a_addr, unsigned long* a_values_buffer, unsigned long a_len);
-void write_value(unsigned long a_addr, unsigned long a_value);
-void write_values(unsigned long a_addr, unsigned long* a_values, unsigned long a_len);
+//a request header in either protocol version
+struct request {
+    unsigned char command;
+    unsigned char flags;
+    uint32_t id;
+    uint32_t length;
+    uint32_t address;
+};
 
-//FPGA memory handlers
-void* map_base = (void*)(-1);
-int fd = -1;
+//state of the periodic push mode
+struct subscription {
+    uint32_t id;
+    int on_change;
+    uint32_t period_us;
+    unsigned int n_ranges;
+    uint32_t ranges[2*MAX_SUBSCRIPTION_RANGES];
+    unsigned int n_words;
+    uint32_t sample_number;
+    struct timespec next_sample;
+    uint32_t last_values[MAX_LENGTH];
+};
+
+//state of the continuous scope acquisition
+struct scope_stream {
+    uint32_t id;
+    int packed;
+    int channels;
+    uint32_t period_us;
+    struct timespec next_poll;
+    uint32_t frame_number;
+    uint32_t overflows;
+    uint64_t sample_index;
+    uint32_t last_write_pointer;
+    uint64_t last_timestamp;
+};
+
+//state of the spectrum stream
+struct spectrum_stream {
+    uint32_t id;
+    int channels;
+    uint32_t n_average;
+    uint32_t period_us;
+    struct timespec next_poll;
+    uint32_t spectrum_number;
+    int lost;
+    uint32_t last_write_pointer;
+    uint64_t last_timestamp;
+    struct spectrum* spectrum;
+};
+
+//state of the trace averaging job
+struct average_job {
+    struct request request;
+    uint32_t n_traces;
+    uint32_t trigger_source;
+    int channels;
+    struct timespec next_poll;
+    struct trace_average* average;
+};
+
+struct connection {
+    int fd;
+    int closed;
+    int version;
+    uint32_t events;
+    struct buffer in;
+    struct buffer out;
+    struct subscription* subscription;
+    struct scope_stream* scope_stream;
+    struct average_job* average_job;
+    struct spectrum_stream* spectrum_stream;
+    struct connection* next;
+};
 
 //sockets are globally defined for error handling
-int sockfd;
-int newsockfd;
+int sockfd = -1;
+int epollfd = -1;
+int timerfd = -1;
+struct connection* connections = NULL;
+//closed connections are freed after all pending events have been handled
+struct connection* closed_connections = NULL;
 
-//open and close memory mapping to FPGA registers
-void open_map_base() {
-    int addr = 0x40000000;
-    if((fd = open("/dev/mem", O_RDWR | O_SYNC)) == -1) FATAL;
-    map_base = mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, addr & ~MAP_MASK);
-    if(map_base == (void *) -1) FATAL;
-}
+//periodic statistics file, if any
+static const char* stats_path = NULL;
+static uint32_t stats_interval = DEFAULT_STATS_INTERVAL;
+static struct timespec next_stats_dump;
 
-void close_map_base() {
-    /*if (map_base != (void*)(-1)) {
-        if(munmap(map_base, MAP_SIZE) == -1) FATAL;
-        map_base = (void*)(-1);
-    }
-    if (fd != -1) {
-        close(fd);
-    }
-    */;
-}
-/*
-//basic read and write operations
-unsigned long* read_values(unsigned long a_addr, unsigned long* a_values_buffer, unsigned long a_len) {
-	unsigned long* virt_addr = map_base + (a_addr & MAP_MASK);
-	unsigned long i;
-	printf("address to read %d",(int)a_addr);
-	for (i = 0; i < a_len; i++) {;
-		a_values_buffer[i] = virt_addr[i];
-	}
-	return a_values_buffer;
-}
-
-void write_values(unsigned long a_addr, unsigned long* a_values, unsigned long a_len) {
-	void* virt_addr = map_base + (a_addr & MAP_MASK);
-	unsigned long i;
-	for (i = 0; i < a_len; i++) {
-		((unsigned long *) virt_addr)[i] = a_values[i];
-	}
-}
-*/
+//epoll tags of the listening socket and the timer, connections are tagged with their own pointer
+static int listener_tag;
+static int timer_tag;
+
+void rearm_timer();
+void free_average_job(struct average_job* job);
+int finish_average_job(struct connection* c);
+void free_spectrum_stream(struct spectrum_stream* stream);
+int serve_requests(struct connection* c);
 
 /* server process and error handling */
 
 void error(const char *msg)
 {
     perror(msg);
-    close(newsockfd);
+    while (connections != NULL) {
+        struct connection* c = connections;
+        connections = c->next;
+        close(c->fd);
+    }
+    close(timerfd);
+    close(epollfd);
     close(sockfd);
     //clean up the memory mapping
-    close_map_base();
+    fpga_map_close();
+    shadow_close();
     exit(-1);
 }
 
+/* buffer handling */
+
+//makes room for n more bytes at the end, returns a pointer to them or NULL if out of memory
+unsigned char* buffer_reserve(struct buffer* b, size_t n) {
+    size_t used = b->end - b->start;
+    //move the data to the front, keeping the 4-byte alignment of the words
+    if (b->start > 0 && b->end + n > b->size) {
+        memmove(b->data + (b->start & 0x3), b->data + b->start, used);
+        b->start &= 0x3;
+        b->end = b->start + used;
+    }
+    if (b->end + n > b->size) {
+        size_t size = b->size ? b->size : RECV_CHUNK;
+        unsigned char* data;
+        while (size < b->end + n)
+            size *= 2;
+        data = realloc(b->data, size);
+        if (data == NULL) return NULL;
+        b->data = data;
+        b->size = size;
+    }
+    return b->data + b->end;
+}
+
+static size_t buffer_used(const struct buffer* b) {
+    return b->end - b->start;
+}
+
+static void buffer_consume(struct buffer* b, size_t n) {
+    b->start += n;
+    if (b->start == b->end)
+        b->start = b->end = 0;
+}
+
+/* protocol helpers */
+
+static unsigned int header_length(const unsigned char* header) {
+    return header[2]+(header[3]<<8);
+}
+
+static uint32_t header_address(const unsigned char* header) {
+    uint32_t address;
+    memcpy(&address, header+4, 4);
+    return address;
+}
+
+static size_t header_size(const struct connection* c) {
+    return c->version >= 2 ? 16 : 8;
+}
+
+static void parse_request(const struct connection* c, const unsigned char* header, struct request* r) {
+    r->command = header[0];
+    r->flags = header[1];
+    if (c->version >= 2) {
+        memcpy(&r->id, header+4, 4);
+        memcpy(&r->length, header+8, 4);
+        memcpy(&r->address, header+12, 4);
+    }
+    else {
+        r->id = 0;
+        r->length = header_length(header);
+        r->address = header_address(header);
+    }
+}
+
+//writes the header of r in the format of the connection
+static void put_header(const struct connection* c, const struct request* r, unsigned char* header) {
+    header[0] = r->command;
+    header[1] = r->flags;
+    if (c->version >= 2) {
+        header[2] = header[3] = 0;
+        memcpy(header+4, &r->id, 4);
+        memcpy(header+8, &r->length, 4);
+        memcpy(header+12, &r->address, 4);
+    }
+    else {
+        header[2] = r->length & 0xFF;
+        header[3] = (r->length >> 8) & 0xFF;
+        memcpy(header+4, &r->address, 4);
+    }
+}
+
+static void timespec_add_us(struct timespec* t, uint32_t us) {
+    t->tv_nsec += us * 1000L;
+    t->tv_sec += t->tv_nsec / 1000000000L;
+    t->tv_nsec %= 1000000000L;
+}
+
+static int timespec_before(const struct timespec* a, const struct timespec* b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+//FPGA accesses, timed for the statistics
+static int timed_read(uint32_t a_addr, uint32_t* a_buffer, uint32_t a_len) {
+    uint64_t start = stats_now();
+    int result = read_values(a_addr, a_buffer, a_len);
+    stats_bus(start);
+    return result;
+}
+
+static int timed_write(uint32_t a_addr, const uint32_t* a_values, uint32_t a_len) {
+    uint64_t start = stats_now();
+    int result = write_values(a_addr, a_values, a_len);
+    stats_bus(start);
+    return result;
+}
+
+//reads a_len words from the FPGA into a_buffer, zeros if the range is invalid
+void read_or_zero(uint32_t a_addr, uint32_t* a_buffer, uint32_t a_len) {
+    if (timed_read(a_addr, a_buffer, a_len) < 0) {
+        fprintf(stderr, "Invalid read of %u words at 0x%08x\n", a_len, a_addr);
+        bzero(a_buffer, a_len*sizeof(uint32_t));
+    }
+}
+
+void write_or_ignore(uint32_t a_addr, const uint32_t* a_values, uint32_t a_len) {
+    if (timed_write(a_addr, a_values, a_len) < 0)
+        fprintf(stderr, "Invalid write of %u words at 0x%08x\n", a_len, a_addr);
+}
+
+//as above, but configuration registers are served from and invalidated in the shadow if it is enabled
+void read_cached(uint32_t a_addr, uint32_t* a_buffer, uint32_t a_len) {
+    if (shadow_read(a_addr, a_buffer, a_len) == 0)
+        return;
+    if (timed_read(a_addr, a_buffer, a_len) < 0) {
+        fprintf(stderr, "Invalid read of %u words at 0x%08x\n", a_len, a_addr);
+        bzero(a_buffer, a_len*sizeof(uint32_t));
+        return;
+    }
+    shadow_store(a_addr, a_buffer, a_len);
+}
+
+void write_cached(uint32_t a_addr, const uint32_t* a_values, uint32_t a_len) {
+    write_or_ignore(a_addr, a_values, a_len);
+    shadow_invalidate(a_addr, a_len);
+}
+
+/* connection handling */
+
+void close_connection(struct connection* c, const char* msg) {
+    struct connection** p;
+    if (c->closed)
+        return;
+    if (msg != NULL)
+        fprintf(stderr, "Closing connection %d: %s\n", c->fd, msg);
+    stats.connections_closed++;
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    for (p = &connections; *p != NULL; p = &(*p)->next)
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    c->closed = 1;
+    c->next = closed_connections;
+    closed_connections = c;
+    if (c->subscription != NULL || c->scope_stream != NULL || c->average_job != NULL || c->spectrum_stream != NULL)
+        rearm_timer();
+}
+
+void free_closed_connections() {
+    struct connection* c;
+    while (closed_connections != NULL) {
+        c = closed_connections;
+        closed_connections = c->next;
+        free(c->in.data);
+        free(c->out.data);
+        free(c->subscription);
+        free(c->scope_stream);
+        free_average_job(c->average_job);
+        free_spectrum_stream(c->spectrum_stream);
+        free(c);
+    }
+}
+
+//only waits for requests as long as the output backlog is small, and for writability while output is pending
+int update_events(struct connection* c) {
+    struct epoll_event ev;
+    uint32_t events = 0;
+    if (buffer_used(&c->out) < MAX_OUTPUT_BACKLOG)
+        events |= EPOLLIN;
+    if (buffer_used(&c->out) > 0)
+        events |= EPOLLOUT;
+    if (events == c->events)
+        return 0;
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+        return -1;
+    c->events = events;
+    return 0;
+}
+
+//sends as much pending output as the socket takes without blocking
+int flush_connection(struct connection* c) {
+    ssize_t n;
+    while (buffer_used(&c->out) > 0) {
+        n = send(c->fd, c->out.data + c->out.start, buffer_used(&c->out), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            return -1;
+        }
+        buffer_consume(&c->out, n);
+    }
+    return update_events(c);
+}
+
+//appends the header of an answer of a_len words to the output, returns where the words go
+static uint32_t* append_answer(struct connection* c, const struct request* r, unsigned int a_len) {
+    size_t size = header_size(c);
+    unsigned char* data = buffer_reserve(&c->out, size + a_len*sizeof(uint32_t));
+    if (data == NULL) return NULL;
+    put_header(c, r, data);
+    c->out.end += size + a_len*sizeof(uint32_t);
+    return (uint32_t*)(data + size);
+}
+
+//as above, and counts the answer in the statistics
+uint32_t* reply(struct connection* c, const struct request* r, unsigned int a_len) {
+    uint32_t* values = append_answer(c, r, a_len);
+    if (values != NULL)
+        stats_bytes_out(r->command, header_size(c) + a_len*sizeof(uint32_t));
+    return values;
+}
+
+/* scope data */
+
+/* Both channels are read exactly once into the output buffer, such that an answer always holds a single read 
+of the scope buffers, even if the socket takes it in several parts while the scope keeps running. */
+int serve_scope_data(struct connection* c, const struct request* r, unsigned int n) {
+    volatile uint32_t* ch1 = fpga_map_ptr(SCOPE_ADDR_BASE + SCOPE_CH1_OFFSET, n);
+    volatile uint32_t* ch2 = fpga_map_ptr(SCOPE_ADDR_BASE + SCOPE_CH2_OFFSET, n);
+    uint16_t* samples;
+    uint32_t* values;
+    unsigned int i;
+    uint64_t start;
+    if (r->flags & 0x1) { //16-bit samples
+        samples = (uint16_t*)reply(c, r, n);
+        if (samples == NULL) return -1;
+        start = stats_now();
+        for (i = 0; i < n; i++)
+            samples[i] = ch1 != NULL ? ch1[i] : 0;
+        for (i = 0; i < n; i++)
+            samples[n+i] = ch2 != NULL ? ch2[i] : 0;
+        stats_bus(start);
+        return 0;
+    }
+    values = reply(c, r, 2*n);
+    if (values == NULL) return -1;
+    read_or_zero(SCOPE_ADDR_BASE + SCOPE_CH1_OFFSET, values, n);
+    read_or_zero(SCOPE_ADDR_BASE + SCOPE_CH2_OFFSET, values + n, n);
+    return 0;
+}
+
+/* scope stream */
+
+static uint32_t scope_register(uint32_t offset) {
+    uint32_t value = 0;
+    timed_read(SCOPE_ADDR_BASE + offset, &value, 1);
+    return value;
+}
+
+//64-bit scope time in cycles, the high word is read twice to catch a carry
+static uint64_t scope_timestamp() {
+    uint32_t high, low;
+    do {
+        high = scope_register(SCOPE_CURRENT_TIMESTAMP + 4);
+        low = scope_register(SCOPE_CURRENT_TIMESTAMP);
+    } while (high != scope_register(SCOPE_CURRENT_TIMESTAMP + 4));
+    return ((uint64_t)high << 32) | low;
+}
+
+int start_scope_stream(struct connection* c, const struct request* r) {
+    struct scope_stream* stream;
+    uint32_t period_us = r->address;
+    if (c->scope_stream == NULL)
+        c->scope_stream = malloc(sizeof(struct scope_stream));
+    stream = c->scope_stream;
+    if (stream == NULL) return -1;
+    stream->id = r->id;
+    stream->packed = r->flags & 0x1;
+    stream->channels = (r->flags >> 1) & 0x3;
+    if (stream->channels == 0)
+        stream->channels = 0x3;
+    stream->period_us = period_us < MIN_PERIOD_US ? MIN_PERIOD_US : period_us;
+    stream->frame_number = 0;
+    stream->overflows = 0;
+    stream->sample_index = 0;
+    stream->last_write_pointer = scope_register(SCOPE_WRITE_POINTER_CURRENT) % SCOPE_DATA_LENGTH;
+    stream->last_timestamp = scope_timestamp();
+    clock_gettime(CLOCK_MONOTONIC, &stream->next_poll);
+    timespec_add_us(&stream->next_poll, stream->period_us);
+    if (reply(c, r, 0) == NULL) return -1;
+    rearm_timer();
+    return 0;
+}
+
+//copies n samples of the circular buffer starting at index first
+static void copy_segment(uint32_t channel_offset, uint32_t first, uint32_t n, int packed, void* dest) {
+    uint32_t i, length;
+    uint16_t* samples = dest;
+    volatile uint32_t* data;
+    uint64_t start;
+    while (n > 0) {
+        length = first + n > SCOPE_DATA_LENGTH ? SCOPE_DATA_LENGTH - first : n;
+        if (!packed)
+            read_or_zero(SCOPE_ADDR_BASE + channel_offset + 4*first, dest, length);
+        else if ((data = fpga_map_ptr(SCOPE_ADDR_BASE + channel_offset + 4*first, length)) != NULL) {
+            start = stats_now();
+            for (i = 0; i < length; i++)
+                samples[i] = data[i];
+            stats_bus(start);
+        }
+        else
+            bzero(samples, length*sizeof(uint16_t));
+        dest += length * (packed ? sizeof(uint16_t) : sizeof(uint32_t));
+        samples = dest;
+        first = (first + length) % SCOPE_DATA_LENGTH;
+        n -= length;
+    }
+}
+
+/* Returns the number n of samples the scope wrote since the last poll, the newest one is at the
+updated *last_write_pointer. *lost is set to the number of samples that were overwritten before. */
+static uint32_t scope_new_samples(uint32_t* last_write_pointer, uint64_t* last_timestamp, uint64_t* lost) {
+    uint32_t write_pointer = scope_register(SCOPE_WRITE_POINTER_CURRENT) % SCOPE_DATA_LENGTH;
+    uint64_t timestamp = scope_timestamp();
+    uint32_t decimation = scope_register(SCOPE_DECIMATION);
+    uint32_t n = (write_pointer - *last_write_pointer) % SCOPE_DATA_LENGTH;
+    //the write pointer alone cannot tell whether the buffer wrapped, the timestamp can
+    uint64_t elapsed = (timestamp - *last_timestamp) / (decimation ? decimation : 1);
+    *lost = 0;
+    if (elapsed >= SCOPE_DATA_LENGTH) {
+        n = SCOPE_DATA_LENGTH - 1;
+        *lost = elapsed - n;
+    }
+    *last_write_pointer = write_pointer;
+    *last_timestamp = timestamp;
+    return n;
+}
+
+//sends all samples the scope wrote since the last poll
+int push_scope_segment(struct connection* c) {
+    struct scope_stream* stream = c->scope_stream;
+    struct request header = {'o', 0, stream->id};
+    size_t size = header_size(c);
+    uint32_t first, n, sample_size, n_channels, channel_bytes;
+    uint64_t lost;
+    unsigned char* frame;
+    struct timespec now;
+    //a client that does not keep up loses samples, this shows up as an overflow later
+    if (buffer_used(&c->out) < MAX_OUTPUT_BACKLOG) {
+        n = scope_new_samples(&stream->last_write_pointer, &stream->last_timestamp, &lost);
+        if (lost > 0) {
+            stream->overflows++;
+            stream->sample_index += lost;
+            header.flags = 0x1;
+        }
+        if (n > 0 || header.flags) {
+            n_channels = stream->channels == 0x3 ? 2 : 1;
+            sample_size = stream->packed ? sizeof(uint16_t) : sizeof(uint32_t);
+            channel_bytes = n * sample_size;
+            header.length = n;
+            header.address = stream->frame_number;
+            frame = buffer_reserve(&c->out, size + 12 + ((n_channels * channel_bytes + 3) & ~3UL));
+            if (frame == NULL) return -1;
+            put_header(c, &header, frame);
+            memcpy(frame+size, &stream->sample_index, 8);
+            memcpy(frame+size+8, &stream->overflows, 4);
+            frame += size + 12;
+            first = (stream->last_write_pointer + 1 - n) % SCOPE_DATA_LENGTH;
+            if (stream->channels & 0x1) {
+                copy_segment(SCOPE_CH1_OFFSET, first, n, stream->packed, frame);
+                frame += channel_bytes;
+            }
+            if (stream->channels & 0x2) {
+                copy_segment(SCOPE_CH2_OFFSET, first, n, stream->packed, frame);
+                frame += channel_bytes;
+            }
+            //padding
+            bzero(frame, ((n_channels * channel_bytes + 3) & ~3UL) - n_channels * channel_bytes);
+            c->out.end += size + 12 + ((n_channels * channel_bytes + 3) & ~3UL);
+            stream->frame_number++;
+            stream->sample_index += n;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    do {
+        timespec_add_us(&stream->next_poll, stream->period_us);
+    } while (!timespec_before(&now, &stream->next_poll));
+    return flush_connection(c);
+}
+
+/* trace averaging */
+
+//resets the scope and arms it for the next trace, as hardware_modules/scope.py does
+static void arm_scope(uint32_t trigger_source) {
+    uint32_t value = 0x2;
+    write_cached(SCOPE_ADDR_BASE + SCOPE_ARM, &value, 1);
+    value = 0x1;
+    write_cached(SCOPE_ADDR_BASE + SCOPE_ARM, &value, 1);
+    //writing the trigger source triggers at once in mode 'immediately'
+    write_cached(SCOPE_ADDR_BASE + SCOPE_TRIGGER_SOURCE, &trigger_source, 1);
+}
+
+void free_average_job(struct average_job* job) {
+    if (job == NULL) return;
+    trace_average_close(job->average);
+    free(job);
+}
+
+int start_average_job(struct connection* c, const struct request* r) {
+    struct average_job* job;
+    uint32_t n_points = r->address & 0xFFFF;
+    int channels = (r->flags >> 1) & 0x3;
+    if (channels == 0)
+        channels = 0x3;
+    job = malloc(sizeof(struct average_job));
+    if (job == NULL) return -1;
+    job->average = trace_average_open(n_points ? n_points : SCOPE_DATA_LENGTH, channels == 0x3 ? 2 : 1, r->flags & 0x1);
+    if (job->average == NULL) {
+        free(job);
+        return -1;
+    }
+    job->request = *r;
+    job->n_traces = r->length;
+    job->trigger_source = (r->address >> 16) & 0xF;
+    job->channels = channels;
+    c->average_job = job;
+    if (job->n_traces == 0) //nothing to acquire, answer with the empty sums
+        return finish_average_job(c);
+    arm_scope(job->trigger_source);
+    clock_gettime(CLOCK_MONOTONIC, &job->next_poll);
+    timespec_add_us(&job->next_poll, MIN_PERIOD_US);
+    rearm_timer();
+    return 0;
+}
+
+//answers the job with the traces summed up so far
+int finish_average_job(struct connection* c) {
+    struct average_job* job = c->average_job;
+    struct request header = job->request;
+    uint32_t* values;
+    header.length = job->average->n_points;
+    header.address = job->average->n_traces;
+    values = reply(c, &header, trace_average_words(job->average));
+    if (values == NULL) return -1;
+    trace_average_result(job->average, values);
+    free_average_job(job);
+    c->average_job = NULL;
+    return 0;
+}
+
+//adds the trace once the scope is done and arms it for the next one
+int poll_average_job(struct connection* c) {
+    static uint32_t buffer[SCOPE_DATA_LENGTH];
+    struct average_job* job = c->average_job;
+    unsigned int channel = 0;
+    uint32_t first;
+    struct timespec now;
+    //neither armed nor waiting for the end of the trigger delay
+    if ((scope_register(SCOPE_ARM) & 0x5) == 0) {
+        first = scope_register(SCOPE_WRITE_POINTER_TRIGGER) + scope_register(SCOPE_TRIGGER_DELAY) + 1;
+        if (job->channels & 0x1) {
+            read_or_zero(SCOPE_ADDR_BASE + SCOPE_CH1_OFFSET, buffer, SCOPE_DATA_LENGTH);
+            trace_average_add(job->average, channel++, buffer, first);
+        }
+        if (job->channels & 0x2) {
+            read_or_zero(SCOPE_ADDR_BASE + SCOPE_CH2_OFFSET, buffer, SCOPE_DATA_LENGTH);
+            trace_average_add(job->average, channel++, buffer, first);
+        }
+        if (job->average->n_traces >= job->n_traces)
+            return finish_average_job(c);
+        arm_scope(job->trigger_source);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    do {
+        timespec_add_us(&job->next_poll, MIN_PERIOD_US);
+    } while (!timespec_before(&now, &job->next_poll));
+    return 0;
+}
+
+/* spectrum stream */
+
+void free_spectrum_stream(struct spectrum_stream* stream) {
+    if (stream == NULL) return;
+    spectrum_close(stream->spectrum);
+    free(stream);
+}
+
+int start_spectrum_stream(struct connection* c, const struct request* r) {
+    struct spectrum_stream* stream;
+    uint32_t period_us = r->address >> 8;
+    int channels = (r->flags >> 1) & 0x3;
+    if (channels == 0)
+        channels = 0x3;
+    if (r->length == 0) return -1; //a spectrum needs at least one segment
+    stream = malloc(sizeof(struct spectrum_stream));
+    if (stream == NULL) return -1;
+    stream->spectrum = spectrum_open(r->address & 0xF, channels == 0x3 ? 2 : 1, (r->address >> 4) & 0xF);
+    if (stream->spectrum == NULL) {
+        free(stream);
+        return -1;
+    }
+    free_spectrum_stream(c->spectrum_stream);
+    c->spectrum_stream = stream;
+    stream->id = r->id;
+    stream->channels = channels;
+    stream->n_average = r->length;
+    stream->period_us = period_us < MIN_PERIOD_US ? MIN_PERIOD_US : period_us;
+    stream->spectrum_number = 0;
+    stream->lost = 0;
+    stream->last_write_pointer = scope_register(SCOPE_WRITE_POINTER_CURRENT) % SCOPE_DATA_LENGTH;
+    stream->last_timestamp = scope_timestamp();
+    clock_gettime(CLOCK_MONOTONIC, &stream->next_poll);
+    timespec_add_us(&stream->next_poll, stream->period_us);
+    if (reply(c, r, 0) == NULL) return -1;
+    rearm_timer();
+    return 0;
+}
+
+//queues the averaged spectrum, or drops it if the client does not keep up
+static int push_spectrum(struct connection* c) {
+    struct spectrum_stream* stream = c->spectrum_stream;
+    struct request header = {'f', stream->lost, stream->id, spectrum_bins(stream->spectrum), stream->spectrum_number};
+    float* values = NULL;
+    if (buffer_used(&c->out) < MAX_OUTPUT_BACKLOG) {
+        values = (float*)reply(c, &header, stream->spectrum->n_channels * header.length);
+        if (values == NULL) return -1;
+    }
+    spectrum_result(stream->spectrum, values);
+    stream->spectrum_number++;
+    stream->lost = 0;
+    return 0;
+}
+
+//feeds all samples the scope wrote since the last poll to the spectrum
+int poll_spectrum_stream(struct connection* c) {
+    static uint32_t samples[2][SCOPE_DATA_LENGTH];
+    struct spectrum_stream* stream = c->spectrum_stream;
+    uint32_t* channel_samples[2] = {samples[0], samples[1]};
+    uint32_t first, n, count, done, half = stream->spectrum->length / 2;
+    unsigned int channel = 0;
+    uint64_t lost;
+    struct timespec now;
+    n = scope_new_samples(&stream->last_write_pointer, &stream->last_timestamp, &lost);
+    //a segment must not span a gap
+    if (lost > 0) {
+        stream->lost = 1;
+        spectrum_restart(stream->spectrum);
+    }
+    first = (stream->last_write_pointer + 1 - n) % SCOPE_DATA_LENGTH;
+    if (stream->channels & 0x1)
+        copy_segment(SCOPE_CH1_OFFSET, first, n, 0, samples[channel++]);
+    if (stream->channels & 0x2)
+        copy_segment(SCOPE_CH2_OFFSET, first, n, 0, samples[channel++]);
+    //at most one segment completes per half segment of samples
+    for (done = 0; done < n; done += count) {
+        count = n - done < half ? n - done : half;
+        spectrum_feed(stream->spectrum, channel_samples, count);
+        channel_samples[0] += count;
+        channel_samples[1] += count;
+        if (stream->spectrum->n_segments >= stream->n_average && push_spectrum(c) < 0)
+            return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    do {
+        timespec_add_us(&stream->next_poll, stream->period_us);
+    } while (!timespec_before(&now, &stream->next_poll));
+    return flush_connection(c);
+}
+
+/* subscriptions */
+
+//samples all subscribed ranges and queues a frame for the client if required
+int push_sample(struct connection* c) {
+    struct subscription* sub = c->subscription;
+    unsigned int i, length, offset = 0;
+    struct request header = {'p', 0, sub->id, sub->n_words, sub->sample_number};
+    uint32_t* values;
+    struct timespec now;
+    //a client that does not keep up misses samples
+    if (buffer_used(&c->out) < MAX_OUTPUT_BACKLOG) {
+        values = append_answer(c, &header, sub->n_words);
+        if (values == NULL) return -1;
+        for (i = 0; i < sub->n_ranges; i++) {
+            length = header_length((unsigned char*)&sub->ranges[2*i]);
+            read_or_zero(sub->ranges[2*i+1], values+offset, length);
+            offset += length;
+        }
+        if (sub->on_change && sub->sample_number > 0 && memcmp(values, sub->last_values, offset*sizeof(uint32_t)) == 0)
+            c->out.end -= header_size(c) + offset*sizeof(uint32_t); //unchanged, drop the frame
+        else {
+            if (sub->on_change)
+                memcpy(sub->last_values, values, offset*sizeof(uint32_t));
+            stats_bytes_out(header.command, header_size(c) + offset*sizeof(uint32_t));
+        }
+    }
+    //schedule the next sample, skipping the ones we are too late for
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    do {
+        sub->sample_number++;
+        timespec_add_us(&sub->next_sample, sub->period_us);
+    } while (!timespec_before(&now, &sub->next_sample));
+    return flush_connection(c);
+}
+
+/* timers */
+
+static void earliest(struct timespec* t, const struct timespec* deadline) {
+    if ((t->tv_sec == 0 && t->tv_nsec == 0) || timespec_before(deadline, t))
+        *t = *deadline;
+}
+
+//programs the timer for the earliest deadline of all connections
+void rearm_timer() {
+    struct itimerspec it;
+    struct connection* c;
+    bzero(&it, sizeof(it));
+    if (stats_path != NULL)
+        earliest(&it.it_value, &next_stats_dump);
+    for (c = connections; c != NULL; c = c->next) {
+        if (c->subscription != NULL)
+            earliest(&it.it_value, &c->subscription->next_sample);
+        if (c->scope_stream != NULL)
+            earliest(&it.it_value, &c->scope_stream->next_poll);
+        if (c->average_job != NULL)
+            earliest(&it.it_value, &c->average_job->next_poll);
+        if (c->spectrum_stream != NULL)
+            earliest(&it.it_value, &c->spectrum_stream->next_poll);
+    }
+    if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &it, NULL) < 0)
+        FATAL;
+}
+
+void service_timers() {
+    struct connection *c, *next;
+    struct timespec now;
+    uint64_t expirations;
+    uint64_t start = stats_now();
+    if (read(timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        FATAL;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (stats_path != NULL && !timespec_before(&now, &next_stats_dump)) {
+        if (stats_dump(stats_path) < 0)
+            perror("ERROR writing statistics");
+        do {
+            next_stats_dump.tv_sec += stats_interval;
+        } while (!timespec_before(&now, &next_stats_dump));
+    }
+    for (c = connections; c != NULL; c = next) {
+        next = c->next;
+        if (c->subscription != NULL && !timespec_before(&now, &c->subscription->next_sample))
+            if (push_sample(c) < 0) {
+                close_connection(c, "error while pushing samples");
+                continue;
+            }
+        if (c->average_job != NULL && !timespec_before(&now, &c->average_job->next_poll)) {
+            if (poll_average_job(c) < 0) {
+                close_connection(c, "error while averaging traces");
+                continue;
+            }
+            //sends the answer and serves the requests that waited for it
+            if (c->average_job == NULL && serve_requests(c) < 0) {
+                close_connection(c, NULL);
+                continue;
+            }
+        }
+        if (c->spectrum_stream != NULL && !timespec_before(&now, &c->spectrum_stream->next_poll))
+            if (poll_spectrum_stream(c) < 0) {
+                close_connection(c, "error while streaming spectra");
+                continue;
+            }
+        if (c->scope_stream != NULL && !timespec_before(&now, &c->scope_stream->next_poll))
+            if (push_scope_segment(c) < 0)
+                close_connection(c, "error while streaming scope data");
+    }
+    stats_timer(start);
+    rearm_timer();
+}
+
+/* requests */
+
+//executes a batch of m entries, returns -1 for an invalid batch
+int serve_batch(struct connection* c, const struct request* r, const uint32_t* entries, unsigned int m,
+                const uint32_t* write_data, unsigned int total_read) {
+    unsigned int i, length;
+    uint32_t* read_data = reply(c, r, total_read);
+    if (read_data == NULL) return -1;
+    for (i = 0; i < m; i++) {
+        length = header_length((const unsigned char*)&entries[2*i]);
+        if (((const unsigned char*)&entries[2*i])[0] == 'r') {
+            read_cached(entries[2*i+1], read_data, length);
+            read_data += length;
+        }
+        else {
+            write_cached(entries[2*i+1], write_data, length);
+            write_data += length;
+        }
+    }
+    return 0;
+}
+
+//applies n (mask, value) pairs to consecutive words starting at address
+void serve_masked_write(uint32_t address, const uint32_t* pairs, unsigned int n) {
+    unsigned int i;
+    uint32_t value;
+    for (i = 0; i < n; i++) {
+        read_cached(address + 4*i, &value, 1);
+        value = (value & ~pairs[2*i]) | (pairs[2*i+1] & pairs[2*i]);
+        write_cached(address + 4*i, &value, 1);
+    }
+}
+
+int start_subscription(struct connection* c, const struct request* r, const uint32_t* ranges, unsigned int m) {
+    struct subscription* sub;
+    unsigned int i, n_words = 0;
+    uint32_t period_us = r->address;
+    if (m > MAX_SUBSCRIPTION_RANGES) return -1;
+    for (i = 0; i < m; i++) {
+        if (((const unsigned char*)&ranges[2*i])[0] != 'r') return -1;
+        n_words += header_length((const unsigned char*)&ranges[2*i]);
+    }
+    if (n_words > MAX_LENGTH) return -1;
+    if (c->subscription == NULL)
+        c->subscription = malloc(sizeof(struct subscription));
+    sub = c->subscription;
+    if (sub == NULL) return -1;
+    memcpy(sub->ranges, ranges, m*8);
+    sub->id = r->id;
+    sub->n_ranges = m;
+    sub->n_words = n_words;
+    sub->on_change = r->flags & 0x1;
+    sub->period_us = period_us < MIN_PERIOD_US ? MIN_PERIOD_US : period_us;
+    sub->sample_number = 0;
+    clock_gettime(CLOCK_MONOTONIC, &sub->next_sample);
+    if (reply(c, r, 0) == NULL) return -1;
+    rearm_timer();
+    return 0;
+}
+
+//answers with the statistics as text
+int serve_stats(struct connection* c, const struct request* r) {
+    static char text[4*MAX_LENGTH];
+    struct request header = *r;
+    size_t length = stats_format(text, sizeof(text));
+    uint32_t* values;
+    header.length = (length + 3) / 4;
+    header.address = length;
+    values = reply(c, &header, header.length);
+    if (values == NULL) return -1;
+    values[header.length - 1] = 0;
+    memcpy(values, text, length);
+    if (r->flags & 0x1)
+        stats_reset();
+    return 0;
+}
+
+//answers with a snapshot of the configuration registers, see shadow.h
+int serve_snapshot(struct connection* c, const struct request* r) {
+    struct request header = *r;
+    unsigned int i;
+    uint32_t* values;
+    header.length = config_words();
+    header.address = config_layout();
+    values = reply(c, &header, header.length);
+    if (values == NULL) return -1;
+    for (i = 0; i < n_config_ranges; values += config_ranges[i].n_words, i++)
+        read_cached(config_ranges[i].address, values, config_ranges[i].n_words);
+    return 0;
+}
+
+/* writes the words of a snapshot that differ from the current configuration, every run of 
+consecutive differing words with a single write. Returns the number of words written, or -1. */
+long restore_snapshot(const uint32_t* snapshot) {
+    unsigned int i;
+    uint32_t j, k, n;
+    long written = 0;
+    uint32_t* current = malloc(config_words() * sizeof(uint32_t));
+    if (current == NULL) return -1;
+    for (i = 0; i < n_config_ranges; snapshot += n, i++) {
+        n = config_ranges[i].n_words;
+        read_cached(config_ranges[i].address, current, n);
+        for (j = 0; j < n; j = k) {
+            while (j < n && current[j] == snapshot[j]) j++;
+            for (k = j; k < n && current[k] != snapshot[k]; k++);
+            if (k > j)
+                write_cached(config_ranges[i].address + 4*j, snapshot + j, k - j);
+            written += k - j;
+        }
+    }
+    free(current);
+    return written;
+}
+
+/* serves the request at the start of the input buffer. 
+Returns the number of bytes consumed, 0 if the request is not complete yet, 
+and -1 if the request is invalid or the client wants to close the connection. */
+long serve_request(struct connection* c) {
+    const unsigned char* buffer = c->in.data + c->in.start;
+    size_t available = buffer_used(&c->in);
+    size_t size = header_size(c);
+    const uint32_t* rw_buffer = (const uint32_t*)(buffer + size);
+    unsigned int i, length, total_read = 0, total_write = 0;
+    uint32_t data_length;
+    uint32_t* values;
+    long written;
+    struct request r;
+
+    if (available < size) return 0;
+    //interpret the header
+    parse_request(c, buffer, &r);
+    if (c->average_job != NULL && r.command != 'u' && r.command != 'c')
+        return 0; //wait for the end of the averaging job
+    data_length = r.length; //number of 32-bit words to be read/written
+    if (data_length > (c->version >= 2 ? MAX_TRANSFER : MAX_LENGTH))
+        return -1;
+    if (r.command == 'c') //close connection
+        return -1;
+    if (r.command == 'u') { //stop push mode, streams and averaging job
+        if (c->average_job != NULL && finish_average_job(c) < 0)
+            return -1;
+        free(c->subscription);
+        c->subscription = NULL;
+        free(c->scope_stream);
+        c->scope_stream = NULL;
+        free_spectrum_stream(c->spectrum_stream);
+        c->spectrum_stream = NULL;
+        rearm_timer();
+        return reply(c, &r, 0) == NULL ? -1 : size;
+    }
+    if (r.command == 'q') //statistics
+        return serve_stats(c, &r) < 0 ? -1 : size;
+    if (r.command == 'g') //configuration snapshot
+        return serve_snapshot(c, &r) < 0 ? -1 : size;
+    if (r.command == 't') //trace averaging, answered when all traces are done
+        return start_average_job(c, &r) < 0 ? -1 : size;
+    if (r.command == 'f') //start spectrum stream
+        return start_spectrum_stream(c, &r) < 0 ? -1 : size;
+    if (r.command == 'o') //start scope stream
+        return start_scope_stream(c, &r) < 0 ? -1 : size;
+    if (r.command == 'v') { //protocol version, the answer still has the old format
+        r.flags = r.flags > PROTOCOL_VERSION ? PROTOCOL_VERSION : (r.flags < 1 ? 1 : r.flags);
+        if (reply(c, &r, 0) == NULL) return -1;
+        c->version = r.flags;
+        return size;
+    }
+    if (data_length == 0)
+        return size;
+    //test for various cases Read, Write, Batch, Masked write, Load snapshot, Scope data, Subscribe
+    switch (r.command) {
+    case 'r': //read from FPGA
+        values = reply(c, &r, data_length);
+        if (values == NULL) return -1;
+        read_cached(r.address, values, data_length);
+        return size;
+    case 'w': //write to FPGA
+        if (available < size + data_length*sizeof(uint32_t)) return 0;
+        write_cached(r.address, rw_buffer, data_length);
+        if (!(c->version >= 2 && (r.flags & FLAG_NO_ACK)) && reply(c, &r, 0) == NULL) return -1;
+        return size + data_length*sizeof(uint32_t);
+    case 'b': //batch of reads and writes
+        if (data_length > MAX_BATCH) return -1;
+        if (available < size + data_length*8) return 0;
+        //check the entries before touching the FPGA
+        for (i = 0; i < data_length; i++) {
+            length = header_length((const unsigned char*)&rw_buffer[2*i]);
+            if (((const unsigned char*)&rw_buffer[2*i])[0] == 'r') total_read += length;
+            else if (((const unsigned char*)&rw_buffer[2*i])[0] == 'w') total_write += length;
+            else return -1;
+        }
+        if (total_read > MAX_LENGTH || total_write > MAX_LENGTH) return -1;
+        if (available < size + data_length*8 + total_write*sizeof(uint32_t)) return 0;
+        if (serve_batch(c, &r, rw_buffer, data_length, rw_buffer + 2*data_length, total_read) < 0)
+            return -1;
+        return size + data_length*8 + total_write*sizeof(uint32_t);
+    case 'm': //masked write
+        if (available < size + data_length*8) return 0;
+        serve_masked_write(r.address, rw_buffer, data_length);
+        if (!(c->version >= 2 && (r.flags & FLAG_NO_ACK)) && reply(c, &r, 0) == NULL) return -1;
+        return size + data_length*8;
+    case 'l': //restore configuration snapshot
+        if (data_length != config_words() || r.address != config_layout()) return -1;
+        if (available < size + data_length*sizeof(uint32_t)) return 0;
+        written = restore_snapshot(rw_buffer);
+        if (written < 0) return -1;
+        r.address = written;
+        if (!(c->version >= 2 && (r.flags & FLAG_NO_ACK)) && reply(c, &r, 0) == NULL) return -1;
+        return size + data_length*sizeof(uint32_t);
+    case 'a': //both scope channels
+        if (data_length > SCOPE_DATA_LENGTH) return -1;
+        return serve_scope_data(c, &r, data_length) < 0 ? -1 : size;
+    case 's': //start push mode
+        if (available < size + data_length*8) return 0;
+        if (start_subscription(c, &r, rw_buffer, data_length) < 0) return -1;
+        return size + data_length*8;
+    default: //if an unknown control sequence is received, disconnect for security reasons
+        return -1;
+    }
+}
+
+//serves all complete requests received so far, as long as the client reads the answers
+int serve_requests(struct connection* c) {
+    long n;
+    unsigned char command;
+    uint64_t start;
+    while (buffer_used(&c->out) < MAX_OUTPUT_BACKLOG) {
+        start = stats_now();
+        stats_bus_ns = 0;
+        command = buffer_used(&c->in) > 0 ? c->in.data[c->in.start] : 0;
+        n = serve_request(c);
+        if (n < 0) {
+            if (command != 'c')
+                stats_request(command, -1, start);
+            return -1;
+        }
+        if (n == 0) break;
+        stats_request(command, n, start);
+        buffer_consume(&c->in, n);
+    }
+    return flush_connection(c);
+}
+
+int receive_requests(struct connection* c) {
+    unsigned char* data = buffer_reserve(&c->in, RECV_CHUNK);
+    ssize_t n;
+    if (data == NULL) return -1;
+    n = recv(c->fd, data, RECV_CHUNK, MSG_DONTWAIT);
+    if (n == 0) return -1; //connection closed by client
+    if (n < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    c->in.end += n;
+    return serve_requests(c);
+}
+
+void accept_connection() {
+    struct sockaddr_in cli_addr;
+    socklen_t clilen = sizeof(cli_addr);
+    struct epoll_event ev;
+    struct connection* c;
+    int fd = accept4(sockfd, (struct sockaddr *) &cli_addr, &clilen, SOCK_NONBLOCK);
+    if (fd < 0) {
+        perror("ERROR on accept");
+        return;
+    }
+    c = calloc(1, sizeof(struct connection));
+    if (c == NULL) {
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->version = 1;
+    c->events = EPOLLIN;
+    ev.events = c->events;
+    ev.data.ptr = c;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        free(c);
+        return;
+    }
+    c->next = connections;
+    connections = c;
+    stats.connections_accepted++;
+    printf("Incoming client connection accepted!\n");
+    fflush(stdout);
+}
+
 int main(int argc, char *argv[])
 {
     int portno;
-    unsigned int data_length;
-    unsigned long address;
-    socklen_t clilen;
-
-     char data_buffer[8+sizeof(unsigned long)*MAX_LENGTH];
-	 unsigned long * rw_buffer =(unsigned long*)&(data_buffer[8]);
-	 char* buffer = (char*)&(data_buffer[0]);
-     
-     struct sockaddr_in serv_addr, cli_addr;
-     int n;
-     if (argc < 2) {
-         fprintf(stderr,"ERROR, no port provided\n");
-         exit(1);
-     }
-     sockfd = socket(AF_INET, SOCK_STREAM, 0);
-     if (sockfd < 0) 
+    struct sockaddr_in serv_addr;
+    struct epoll_event ev, events[MAX_EVENTS];
+    int i, n, shadow = 0;
+    const struct fpga_backend* backend = &fpga_mem_backend;
+    while ((i = getopt(argc, argv, "sb:d:i:")) != -1) {
+        if (i == 's')
+            shadow = 1;
+        else if (i == 'b' && (backend = fpga_find_backend(optarg)) != NULL)
+            continue;
+        else if (i == 'd')
+            stats_path = optarg;
+        else if (i == 'i' && atoi(optarg) > 0)
+            stats_interval = atoi(optarg);
+        else {
+            fprintf(stderr,"Usage: %s [-s] [-b mem|sim] [-d STATS-FILE [-i SECONDS]] PORT-NUMBER [MEMORY-FILE]\n", argv[0]);
+            exit(1);
+        }
+    }
+    stats_reset();
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (argc < 2) {
+        fprintf(stderr,"ERROR, no port provided\n");
+        exit(1);
+    }
+    //map the FPGA memory once for the lifetime of the server
+    if (fpga_map_open(backend, argc > 2 ? argv[2] : backend->default_path) < 0)
+        FATAL;
+    if (shadow && shadow_open() < 0)
+        FATAL;
+    //a client that disconnects must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sockfd < 0) 
         error("ERROR opening socket");
     int enable = 1;
     if (setsockopt(sockfd,SOL_SOCKET,SO_REUSEADDR,&enable,sizeof(int))<0)
@@ -184,104 +1356,55 @@ int main(int argc, char *argv[])
     if (bind(sockfd, (struct sockaddr *) &serv_addr,
              sizeof(serv_addr)) < 0)
         error("ERROR on binding");
-    listen(sockfd,5);
-    clilen = sizeof(cli_addr);
-    newsockfd = accept(sockfd,
-                       (struct sockaddr *) &cli_addr,
-                       &clilen);
-    if (newsockfd < 0)
-        error("ERROR on accept");
-    else
-        printf("Incoming client connection accepted!");
-
-    //open_map_base();
+    if (listen(sockfd,5) < 0)
+        error("ERROR on listen");
+
+    epollfd = epoll_create1(0);
+    if (epollfd < 0)
+        error("ERROR creating epoll instance");
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timerfd < 0)
+        error("ERROR creating timer");
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listener_tag;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &ev) < 0)
+        error("ERROR adding socket to epoll");
+    ev.data.ptr = &timer_tag;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, timerfd, &ev) < 0)
+        error("ERROR adding timer to epoll");
+    if (stats_path != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &next_stats_dump);
+        next_stats_dump.tv_sec += stats_interval;
+        rearm_timer();
+    }
+
     //service loop
     while (0==0) {
-        //read next header from client
-        bzero(buffer,8);
-        n = recv(newsockfd,buffer,8,MSG_WAITALL);
-        if (n < 0) error("ERROR reading from socket");
-        if (n != 8) error("ERROR reading from socket - incorrect header length");
-        //confirm control sequence
-        ////n=send(newsockfd,buffer,8,0);
-        ////if (n != 8) error("ERROR control sequence mirror incorreclty transmitted");
-        //interpret the header
-        address = ((unsigned long*)buffer)[1]; //address to be read/written
-        data_length = buffer[2]+(buffer[3]<<8); //number of "unsigned long" to be read/written
-        if (data_length > MAX_LENGTH)
-            data_length = MAX_LENGTH;
-        if (data_length == 0)
-            continue;
-            //test for various cases Read, Write, Close
-        else if (buffer[0] == 'r') { //read from FPGA
-            read_values(address, rw_buffer, data_length);
-            //send the data
-            n = send(newsockfd,(void*)data_buffer,data_length*sizeof(unsigned long)+8,0);
-            if (n < 0) error("ERROR writing to socket");
-            if (n != data_length*sizeof(unsigned long)+8) error("ERROR wrote incorrect number of bytes to socket");
+        n = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            error("ERROR waiting for events");
         }
-        else if  (buffer[0] == 'w') { //write to FPGA
-            //read new data from socket
-            n = recv(newsockfd,(void*)rw_buffer,data_length*sizeof(unsigned long),MSG_WAITALL);
-            if (n < 0) error("ERROR reading from socket");
-            if (n != data_length*sizeof(unsigned long)) error("ERROR read incorrect number of bytes to socket");
-            //write FPGA memory
-            write_values(address, rw_buffer, data_length);
-            n=send(newsockfd,buffer,8,0);
-            if (n != 8) error("ERROR control sequence mirror incorreclty transmitted");
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == &listener_tag)
+                accept_connection();
+            else if (events[i].data.ptr == &timer_tag)
+                service_timers();
+            else {
+                struct connection* c = events[i].data.ptr;
+                //answers are flushed first, then new requests are served
+                if (c->closed)
+                    continue;
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                    close_connection(c, NULL);
+                else if ((events[i].events & EPOLLOUT) && serve_requests(c) < 0)
+                    close_connection(c, NULL);
+                else if ((events[i].events & EPOLLIN) && receive_requests(c) < 0)
+                    close_connection(c, NULL);
+            }
         }
-        else if (buffer[0] == 'c') break; //close program
-        else error("ERROR unknown control character - server and client out of sync"); //if an unknown control sequence is received, terminate for security reasons
+        free_closed_connections();
     }
-    //close the socket
-    close(newsockfd);
-    close(sockfd);
-    //clean up the memory mapping
-    close_map_base();
     return 0;
 }
-
-
-// old version with steady reinstantiation of mmap (slow)
-unsigned long* read_values(unsigned long a_addr, unsigned long* a_values_buffer, unsigned long a_len) {
-    int fd = -1;
-    if((fd = open("/dev/mem", O_RDWR | O_SYNC)) == -1) FATAL;
-    map_base = mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, a_addr & ~MAP_MASK);
-    if(map_base == (void *) -1) FATAL;
-
-    void* virt_addr = map_base + (a_addr & MAP_MASK);
-    unsigned long i;
-    for (i = 0; i < a_len; i++) {
-        a_values_buffer[i] = ((unsigned long*) virt_addr)[i];
-    }
-
-    if (map_base != (void*)(-1)) {
-        if(munmap(map_base, MAP_SIZE) == -1) FATAL;
-        map_base = (void*)(-1);
-    }
-    if (fd != -1) {
-        close(fd);
-    }
-    return a_values_buffer;
-}
-
-void write_values(unsigned long a_addr, unsigned long* a_values, unsigned long a_len) {
-    int fd = -1;
-    if((fd = open("/dev/mem", O_RDWR | O_SYNC)) == -1) FATAL;
-    map_base = mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, a_addr & ~MAP_MASK);
-    if(map_base == (void *) -1) FATAL;
-
-    void* virt_addr = map_base + (a_addr & MAP_MASK);
-    unsigned long i;
-    for (i = 0; i < a_len; i++) {
-        ((unsigned long *) virt_addr)[i] = a_values[i];
-    }
-
-    if (map_base != (void*)(-1)) {
-        if(munmap(map_base, MAP_SIZE) == -1) FATAL;
-        map_base = (void*)(-1);
-    }
-    if (fd != -1) {
-        close(fd);
-    }
-}
@@ -0,0 +1,186 @@
+/*
+###############################################################################
+#    pyrplockbox - DSP servo controller for quantum optics with the RedPitaya
+#    Copyright (C) 2014-2016  Leonhard Neuhaus  (neuhaus@spectro.jussieu.fr)
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+###############################################################################
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "fpga_map.h"
+#include "shadow.h"
+
+#define HK_ADDR_BASE 0x40000000UL
+#define ASG_ADDR_BASE 0x40200000UL
+#define DSP_ADDR_BASE(n) (0x40300000UL + (n)*0x10000UL)
+#define AMS_ADDR_BASE 0x40400000UL
+#define FADS_ADDR_BASE 0x40600000UL
+
+//the fads thresholds are stored per channel, 6 channels every 0x20 bytes
+#define FADS_THRESHOLDS(k, name) {FADS_ADDR_BASE + 0x1000 + (k)*0x20, 6, name}
+
+const struct config_range config_ranges[] = {
+    {HK_ADDR_BASE + 0x0C, 5, "hk digital loop and expansion outputs"},
+    {HK_ADDR_BASE + 0x30, 1, "hk led"},
+    {SCOPE_ADDR_BASE + 0x08, 4, "scope threshold, trigger delay and decimation"},
+    {SCOPE_ADDR_BASE + 0x20, 3, "scope hysteresis and averaging"},
+    {SCOPE_ADDR_BASE + 0x90, 1, "scope trigger debounce"},
+    {ASG_ADDR_BASE + 0x04, 4, "asg0 amplitude, size, offset, step"},
+    {ASG_ADDR_BASE + 0x18, 7, "asg0 bursts and asg1 amplitude, size, offset, step"},
+    {ASG_ADDR_BASE + 0x38, 3, "asg1 bursts"},
+    {ASG_ADDR_BASE + 0x118, 2, "asg0 advanced trigger delay"},
+    {ASG_ADDR_BASE + 0x138, 2, "asg1 advanced trigger delay"},
+    {DSP_ADDR_BASE(0) + 0x0, 2, "pid0 input and output"},
+    {DSP_ADDR_BASE(0) + 0x104, 4, "pid0 setpoint and gains"},
+    {DSP_ADDR_BASE(0) + 0x120, 3, "pid0 filter and limits"},
+    {DSP_ADDR_BASE(1) + 0x0, 2, "pid1 input and output"},
+    {DSP_ADDR_BASE(1) + 0x104, 4, "pid1 setpoint and gains"},
+    {DSP_ADDR_BASE(1) + 0x120, 3, "pid1 filter and limits"},
+    {DSP_ADDR_BASE(2) + 0x0, 2, "pid2 input and output"},
+    {DSP_ADDR_BASE(2) + 0x104, 4, "pid2 setpoint and gains"},
+    {DSP_ADDR_BASE(2) + 0x120, 3, "pid2 filter and limits"},
+    {DSP_ADDR_BASE(3) + 0x0, 2, "trig input and output"},
+    //the iir coefficients cannot be read back
+    {DSP_ADDR_BASE(4) + 0x0, 2, "iir input and output"},
+    {DSP_ADDR_BASE(4) + 0x100, 2, "iir loops, on and shortcut"},
+    {DSP_ADDR_BASE(4) + 0x120, 1, "iir input filter"},
+    {DSP_ADDR_BASE(5) + 0x0, 2, "iq0 input and output"},
+    {DSP_ADDR_BASE(5) + 0x100, 10, "iq0 on, phases, output, gains and filters"},
+    {DSP_ADDR_BASE(5) + 0x130, 2, "iq0 na averages and sleep cycles"},
+    {DSP_ADDR_BASE(6) + 0x0, 2, "iq1 input and output"},
+    {DSP_ADDR_BASE(6) + 0x100, 10, "iq1 on, phases, output, gains and filters"},
+    {DSP_ADDR_BASE(6) + 0x130, 2, "iq1 na averages and sleep cycles"},
+    {DSP_ADDR_BASE(7) + 0x0, 2, "iq2 input and output"},
+    {DSP_ADDR_BASE(7) + 0x100, 10, "iq2 on, phases, output, gains and filters"},
+    {DSP_ADDR_BASE(7) + 0x130, 2, "iq2 na averages and sleep cycles"},
+    {AMS_ADDR_BASE + 0x20, 4, "ams pwm dacs"},
+    {FADS_ADDR_BASE + 0x24, 2, "fads sort timing"},
+    {FADS_ADDR_BASE + 0x300, 2, "fads enabled channels and sensing address"},
+    FADS_THRESHOLDS(0, "fads min intensity"),
+    FADS_THRESHOLDS(1, "fads low intensity"),
+    FADS_THRESHOLDS(2, "fads high intensity"),
+    FADS_THRESHOLDS(3, "fads min width"),
+    FADS_THRESHOLDS(4, "fads low width"),
+    FADS_THRESHOLDS(5, "fads high width"),
+    FADS_THRESHOLDS(6, "fads min area"),
+    FADS_THRESHOLDS(7, "fads low area"),
+    FADS_THRESHOLDS(8, "fads high area"),
+};
+
+const unsigned int n_config_ranges = sizeof(config_ranges) / sizeof(config_ranges[0]);
+
+//total number of words of all ranges
+uint32_t config_words() {
+    unsigned int i;
+    uint32_t n_words = 0;
+    for (i = 0; i < n_config_ranges; i++)
+        n_words += config_ranges[i].n_words;
+    return n_words;
+}
+
+//FNV-1a hash of the addresses and lengths of all ranges
+uint32_t config_layout() {
+    unsigned int i, j;
+    uint32_t hash = 2166136261U, fields[2];
+    for (i = 0; i < n_config_ranges; i++) {
+        fields[0] = config_ranges[i].address;
+        fields[1] = config_ranges[i].n_words;
+        for (j = 0; j < 8; j++) {
+            hash ^= (fields[j / 4] >> (8 * (j % 4))) & 0xFF;
+            hash *= 16777619U;
+        }
+    }
+    return hash;
+}
+
+//the words of all ranges one after the other, NULL while the shadow is disabled
+static uint32_t* words = NULL;
+static unsigned char* valid = NULL;
+
+int shadow_open() {
+    uint32_t n_words = config_words();
+    words = calloc(n_words, sizeof(uint32_t));
+    valid = calloc(n_words, 1);
+    if (words == NULL || valid == NULL) {
+        shadow_close();
+        return -1;
+    }
+    return 0;
+}
+
+void shadow_close() {
+    free(words);
+    free(valid);
+    words = NULL;
+    valid = NULL;
+}
+
+/* finds the part of range i that overlaps with a_len words at a_addr. 
+Returns the number of common words, and their first index in the range and in the request. */
+static uint32_t overlap(unsigned int i, uint32_t a_addr, uint32_t a_len, uint32_t* in_range, uint32_t* in_request) {
+    uint64_t start = config_ranges[i].address, end = start + 4 * (uint64_t)config_ranges[i].n_words;
+    uint64_t first = a_addr, last = first + 4 * (uint64_t)a_len;
+    if (a_addr & 0x3) return 0;
+    if (first > start) start = first;
+    if (last < end) end = last;
+    if (start >= end) return 0;
+    *in_range = (start - config_ranges[i].address) / 4;
+    *in_request = (start - first) / 4;
+    return (end - start) / 4;
+}
+
+//copies a_len words at a_addr from the shadow, returns -1 unless all of them are known
+int shadow_read(uint32_t a_addr, uint32_t* a_values, uint32_t a_len) {
+    unsigned int i, offset = 0;
+    uint32_t j, n, in_range, in_request, found = 0;
+    if (words == NULL) return -1;
+    for (i = 0; i < n_config_ranges && found < a_len; offset += config_ranges[i].n_words, i++) {
+        n = overlap(i, a_addr, a_len, &in_range, &in_request);
+        for (j = 0; j < n; j++) {
+            if (!valid[offset + in_range + j]) return -1;
+            a_values[in_request + j] = words[offset + in_range + j];
+        }
+        found += n;
+    }
+    return found == a_len ? 0 : -1;
+}
+
+//remembers the words of the configuration registers among a_len words read at a_addr
+void shadow_store(uint32_t a_addr, const uint32_t* a_values, uint32_t a_len) {
+    unsigned int i, offset = 0;
+    uint32_t j, n, in_range, in_request;
+    if (words == NULL) return;
+    for (i = 0; i < n_config_ranges; offset += config_ranges[i].n_words, i++) {
+        n = overlap(i, a_addr, a_len, &in_range, &in_request);
+        for (j = 0; j < n; j++) {
+            words[offset + in_range + j] = a_values[in_request + j];
+            valid[offset + in_range + j] = 1;
+        }
+    }
+}
+
+void shadow_invalidate(uint32_t a_addr, uint32_t a_len) {
+    unsigned int i, offset = 0;
+    uint32_t n, in_range, in_request;
+    if (words == NULL) return;
+    for (i = 0; i < n_config_ranges; offset += config_ranges[i].n_words, i++) {
+        n = overlap(i, a_addr, a_len, &in_range, &in_request);
+        if (n > 0)
+            memset(valid + offset + in_range, 0, n);
+    }
+}
@@ -0,0 +1,66 @@
+/*
+###############################################################################
+#    pyrplockbox - DSP servo controller for quantum optics with the RedPitaya
+#    Copyright (C) 2014-2016  Leonhard Neuhaus  (neuhaus@spectro.jussieu.fr)
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+###############################################################################
+ */
+
+/*
+Shadow copy of the FPGA configuration registers.
+
+config_ranges lists the registers that only change when they are written over
+the bus and read back what was last written (up to unused bits), taken from
+the read multiplexers of the FPGA modules. Status registers, counters, live
+signals and registers with side effects (scope arm/reset at 0x0, the scope
+trigger source that clears itself on a trigger, the asg config at 0x0 whose
+writes trigger and reset the generators, the fads reset) are left out.
+
+When the shadow is enabled, a word of these ranges is read from the FPGA once
+and then served from memory. A write invalidates the written words, such that
+the next read fetches the value as the FPGA stores it, e.g. with the unused
+bits cleared. The shadow assumes that the server is the only program that
+writes to these registers.
+
+The same ranges make up the configuration snapshots of the server. A snapshot
+is the words of all ranges one after the other. config_layout() identifies
+the table, such that a snapshot is only restored by a server that lays out
+its words in the same way.
+*/
+
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include <stdint.h>
+
+struct config_range {
+    uint32_t address;
+    uint32_t n_words;
+    const char* name;
+};
+
+extern const struct config_range config_ranges[];
+extern const unsigned int n_config_ranges;
+
+uint32_t config_words(void);
+uint32_t config_layout(void);
+
+int shadow_open(void);
+void shadow_close(void);
+int shadow_read(uint32_t a_addr, uint32_t* a_values, uint32_t a_len);
+void shadow_store(uint32_t a_addr, const uint32_t* a_values, uint32_t a_len);
+void shadow_invalidate(uint32_t a_addr, uint32_t a_len);
+
+#endif
@@ -0,0 +1,211 @@
+/*
+###############################################################################
+#    pyrplockbox - DSP servo controller for quantum optics with the RedPitaya
+#    Copyright (C) 2014-2016  Leonhard Neuhaus  (neuhaus@spectro.jussieu.fr)
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+###############################################################################
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "spectrum.h"
+
+//sign extension of the 14-bit scope samples
+#define SAMPLE(word) ((float)(((int32_t)((word) << 18)) >> 18))
+
+static float window_value(unsigned int window, unsigned int n, unsigned int length) {
+    double x = 2 * M_PI * n / (length - 1);
+    switch (window) {
+    case WINDOW_HANN: return 0.5 - 0.5 * cos(x);
+    case WINDOW_HAMMING: return 0.54 - 0.46 * cos(x);
+    case WINDOW_BLACKMAN: return 0.42 - 0.5 * cos(x) + 0.08 * cos(2 * x);
+    case WINDOW_FLATTOP: return 0.21557895 - 0.41663158 * cos(x) + 0.277263158 * cos(2 * x)
+                                - 0.083578947 * cos(3 * x) + 0.006947368 * cos(4 * x);
+    default: return 1;
+    }
+}
+
+static float* alloc_floats(size_t n) {
+    return calloc(n, sizeof(float));
+}
+
+//returns NULL for an invalid length or window, or on allocation failure
+struct spectrum* spectrum_open(unsigned int log2_length, unsigned int n_channels, unsigned int window) {
+    struct spectrum* s;
+    unsigned int i, j, k, h, half, bits;
+    double sum2 = 0;
+    if (log2_length < SPECTRUM_MIN_LOG2_LENGTH || log2_length > SPECTRUM_MAX_LOG2_LENGTH || window >= N_WINDOWS)
+        return NULL;
+    s = calloc(1, sizeof(struct spectrum));
+    if (s == NULL) return NULL;
+    s->length = 1U << log2_length;
+    s->n_channels = n_channels;
+    half = s->length / 2;
+    s->window = alloc_floats(s->length);
+    s->reversed = malloc(half * sizeof(uint32_t));
+    s->twiddle_re = alloc_floats(half);
+    s->twiddle_im = alloc_floats(half);
+    s->split_re = alloc_floats(half);
+    s->split_im = alloc_floats(half);
+    s->re = alloc_floats(half);
+    s->im = alloc_floats(half);
+    s->segments = alloc_floats(n_channels * s->length);
+    s->power = alloc_floats(n_channels * (half + 1));
+    if (s->window == NULL || s->reversed == NULL || s->twiddle_re == NULL || s->twiddle_im == NULL
+        || s->split_re == NULL || s->split_im == NULL || s->re == NULL || s->im == NULL
+        || s->segments == NULL || s->power == NULL) {
+        spectrum_close(s);
+        return NULL;
+    }
+    for (i = 0; i < s->length; i++) {
+        s->window[i] = window_value(window, i, s->length);
+        sum2 += (double)s->window[i] * s->window[i];
+    }
+    s->norm = 1 / sum2;
+    bits = log2_length - 1;
+    for (i = 0; i < half; i++) {
+        for (j = 0, k = 0; k < bits; k++)
+            j |= ((i >> k) & 1) << (bits - 1 - k);
+        s->reversed[i] = j;
+    }
+    //the stage combining blocks of h points uses the h entries starting at h - 1
+    for (h = 1; h < half; h *= 2)
+        for (k = 0; k < h; k++) {
+            s->twiddle_re[h - 1 + k] = cos(M_PI * k / h);
+            s->twiddle_im[h - 1 + k] = -sin(M_PI * k / h);
+        }
+    for (k = 0; k < half; k++) {
+        s->split_re[k] = cos(M_PI * k / half);
+        s->split_im[k] = -sin(M_PI * k / half);
+    }
+    return s;
+}
+
+void spectrum_close(struct spectrum* s) {
+    if (s == NULL) return;
+    free(s->window);
+    free(s->reversed);
+    free(s->twiddle_re);
+    free(s->twiddle_im);
+    free(s->split_re);
+    free(s->split_im);
+    free(s->re);
+    free(s->im);
+    free(s->segments);
+    free(s->power);
+    free(s);
+}
+
+//one radix-2 stage of the in-place FFT, combining blocks of h points
+static void fft_stage(float* restrict re, float* restrict im, const float* restrict twiddle_re,
+                      const float* restrict twiddle_im, unsigned int h, unsigned int n) {
+    unsigned int j, k;
+    float tr, ti;
+    for (j = 0; j < n; j += 2 * h) {
+        float* restrict ar = re + j;
+        float* restrict ai = im + j;
+        float* restrict br = re + j + h;
+        float* restrict bi = im + j + h;
+        for (k = 0; k < h; k++) {
+            tr = br[k] * twiddle_re[k] - bi[k] * twiddle_im[k];
+            ti = br[k] * twiddle_im[k] + bi[k] * twiddle_re[k];
+            br[k] = ar[k] - tr;
+            bi[k] = ai[k] - ti;
+            ar[k] += tr;
+            ai[k] += ti;
+        }
+    }
+}
+
+/* Adds the power of a segment. The even and odd samples are transformed as the real and
+imaginary parts of a complex FFT of half the length, then split into the real spectrum. */
+static void add_segment(struct spectrum* s, const float* restrict segment, float* restrict power) {
+    const unsigned int half = s->length / 2;
+    float* restrict re = s->re;
+    float* restrict im = s->im;
+    const float* restrict window = s->window;
+    const float* restrict split_re = s->split_re;
+    const float* restrict split_im = s->split_im;
+    unsigned int k, h;
+    float even_re, even_im, odd_re, odd_im, xr, xi;
+    for (k = 0; k < half; k++) {
+        re[s->reversed[k]] = segment[2 * k] * window[2 * k];
+        im[s->reversed[k]] = segment[2 * k + 1] * window[2 * k + 1];
+    }
+    for (h = 1; h < half; h *= 2)
+        fft_stage(re, im, s->twiddle_re + h - 1, s->twiddle_im + h - 1, h, half);
+    //X[0] and X[length/2] from Z[0]
+    power[0] += (re[0] + im[0]) * (re[0] + im[0]) * s->norm;
+    power[half] += (re[0] - im[0]) * (re[0] - im[0]) * s->norm;
+    for (k = 1; k < half; k++) {
+        //even and odd parts of the spectrum from Z[k] and conj(Z[half - k])
+        even_re = 0.5f * (re[k] + re[half - k]);
+        even_im = 0.5f * (im[k] - im[half - k]);
+        odd_re = 0.5f * (im[k] + im[half - k]);
+        odd_im = -0.5f * (re[k] - re[half - k]);
+        xr = even_re + odd_re * split_re[k] - odd_im * split_im[k];
+        xi = even_im + odd_re * split_im[k] + odd_im * split_re[k];
+        power[k] += 2 * (xr * xr + xi * xi) * s->norm;
+    }
+}
+
+/* Appends n new samples of every channel, samples[c] holding the raw scope words of channel c.
+Every complete segment is transformed, the next one starts with its second half. */
+void spectrum_feed(struct spectrum* s, uint32_t* const* samples, uint32_t n) {
+    unsigned int c, i, count;
+    float* segment;
+    uint32_t done = 0;
+    while (done < n) {
+        count = s->length - s->fill < n - done ? s->length - s->fill : n - done;
+        for (c = 0; c < s->n_channels; c++) {
+            segment = s->segments + c * s->length + s->fill;
+            for (i = 0; i < count; i++)
+                segment[i] = SAMPLE(samples[c][done + i]);
+        }
+        s->fill += count;
+        done += count;
+        if (s->fill == s->length) {
+            for (c = 0; c < s->n_channels; c++) {
+                segment = s->segments + c * s->length;
+                add_segment(s, segment, s->power + c * (s->length / 2 + 1));
+                memmove(segment, segment + s->length / 2, s->length / 2 * sizeof(float));
+            }
+            s->fill = s->length / 2;
+            s->n_segments++;
+        }
+    }
+}
+
+//drops the samples of the current segment, e.g. after a gap
+void spectrum_restart(struct spectrum* s) {
+    s->fill = 0;
+}
+
+//number of bins per channel
+uint32_t spectrum_bins(const struct spectrum* s) {
+    return s->length / 2 + 1;
+}
+
+//writes the mean power of all channels unless dest is NULL, and starts the next average
+void spectrum_result(struct spectrum* s, float* dest) {
+    unsigned int i, n = s->n_channels * spectrum_bins(s);
+    for (i = 0; dest != NULL && i < n; i++)
+        dest[i] = s->n_segments ? s->power[i] / s->n_segments : 0;
+    bzero(s->power, n * sizeof(float));
+    s->n_segments = 0;
+}
@@ -0,0 +1,84 @@
+/*
+###############################################################################
+#    pyrplockbox - DSP servo controller for quantum optics with the RedPitaya
+#    Copyright (C) 2014-2016  Leonhard Neuhaus  (neuhaus@spectro.jussieu.fr)
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+###############################################################################
+ */
+
+/*
+Welch power spectra of scope samples for the spectrum stream of the server.
+
+The samples of every channel are cut into segments of 2^log2_length samples
+that overlap by half. Each segment is multiplied with the window and
+transformed with a real FFT, and the powers of all segments are summed up
+until spectrum_result() returns their mean and starts over. Bin k of the
+result is |X_k|^2 / sum(w^2) of the one-sided spectrum (bins 1 to
+length/2 - 1 doubled), in squared ADC units, such that dividing by the
+sample rate gives the power spectral density as scipy.signal.welch does
+without detrending.
+
+The kernels work on separate arrays of real and imaginary parts with
+contiguous twiddle tables per stage, such that the compiler vectorizes the
+inner loops (NEON on the board, SSE/AVX on x86, see the Makefile).
+*/
+
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+#include <stdint.h>
+
+#define SPECTRUM_MIN_LOG2_LENGTH 6
+#define SPECTRUM_MAX_LOG2_LENGTH 14
+
+//same windows as software_modules/spectrum_analyzer.py, symmetric as there
+enum spectrum_window {
+    WINDOW_BOXCAR,
+    WINDOW_HANN,
+    WINDOW_HAMMING,
+    WINDOW_BLACKMAN,
+    WINDOW_FLATTOP,
+    N_WINDOWS
+};
+
+struct spectrum {
+    unsigned int length;
+    unsigned int n_channels;
+    float* window;
+    float norm;
+    //complex FFT of length/2 points: bit reversal, twiddles of all stages, post-processing twiddles
+    uint32_t* reversed;
+    float* twiddle_re;
+    float* twiddle_im;
+    float* split_re;
+    float* split_im;
+    float* re;
+    float* im;
+    //the samples of the current segment of every channel
+    float* segments;
+    unsigned int fill;
+    //sum of the powers, length/2 + 1 bins per channel
+    float* power;
+    uint32_t n_segments;
+};
+
+struct spectrum* spectrum_open(unsigned int log2_length, unsigned int n_channels, unsigned int window);
+void spectrum_close(struct spectrum* s);
+void spectrum_feed(struct spectrum* s, uint32_t* const* samples, uint32_t n);
+void spectrum_restart(struct spectrum* s);
+uint32_t spectrum_bins(const struct spectrum* s);
+void spectrum_result(struct spectrum* s, float* dest);
+
+#endif
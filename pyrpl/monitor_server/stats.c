@@ -0,0 +1,154 @@
+/*
+###############################################################################
+#    pyrplockbox - DSP servo controller for quantum optics with the RedPitaya
+#    Copyright (C) 2014-2016  Leonhard Neuhaus  (neuhaus@spectro.jussieu.fr)
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+###############################################################################
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <ctype.h>
+#include <stdarg.h>
+
+#include "stats.h"
+
+struct server_stats stats;
+uint64_t stats_bus_ns;
+
+uint64_t stats_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+void stats_reset(void) {
+    bzero(&stats, sizeof(stats));
+    stats.start_ns = stats_now();
+}
+
+static void add_to_histogram(uint64_t* histogram, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    unsigned int bucket = 0;
+    while (us > 0 && bucket < STATS_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    histogram[bucket]++;
+}
+
+//adds the time since start_ns to the FPGA access time of the current request
+void stats_bus(uint64_t start_ns) {
+    stats_bus_ns += stats_now() - start_ns;
+}
+
+//accounts a served request that started at start_ns, bytes_in < 0 for an invalid one
+void stats_request(unsigned char command, long bytes_in, uint64_t start_ns) {
+    struct command_stats* s = &stats.commands[command];
+    uint64_t ns = stats_now() - start_ns;
+    if (bytes_in < 0) {
+        s->invalid++;
+        return;
+    }
+    s->requests++;
+    s->bytes_in += bytes_in;
+    s->service_ns += ns;
+    s->bus_ns += stats_bus_ns;
+    add_to_histogram(s->service_hist, ns);
+    add_to_histogram(s->bus_hist, stats_bus_ns);
+}
+
+void stats_bytes_out(unsigned char command, size_t n) {
+    stats.commands[command].bytes_out += n;
+}
+
+void stats_timer(uint64_t start_ns) {
+    stats.timer_runs++;
+    add_to_histogram(stats.timer_hist, stats_now() - start_ns);
+}
+
+//appends to the text, which is truncated at size - 1 characters, returns the new length
+static size_t append(char* text, size_t size, size_t length, const char* format, ...) {
+    va_list args;
+    int n;
+    if (length >= size - 1) return length;
+    va_start(args, format);
+    n = vsnprintf(text + length, size - length, format, args);
+    va_end(args);
+    return n < 0 ? length : (length + n < size - 1 ? length + n : size - 1);
+}
+
+static size_t append_histogram(char* text, size_t size, size_t length, const uint64_t* histogram) {
+    unsigned int i;
+    for (i = 0; i < STATS_BUCKETS; i++)
+        length = append(text, size, length, " %llu", (unsigned long long)histogram[i]);
+    return append(text, size, length, "\n");
+}
+
+//commands that are no printable character, i.e. invalid ones, are written in hex
+static size_t append_command(char* text, size_t size, size_t length, unsigned int c) {
+    return isgraph(c) ? append(text, size, length, "command %c", c) : append(text, size, length, "command 0x%02x", c);
+}
+
+//writes the statistics as text, returns its length without the terminating zero
+size_t stats_format(char* text, size_t size) {
+    size_t length = 0;
+    unsigned int c;
+    const struct command_stats* s;
+    text[0] = '\0';
+    length = append(text, size, length, "uptime_s %.3f\nconnections_accepted %llu\nconnections_closed %llu\n"
+                    "timer_runs %llu\ntimer_hist", (stats_now() - stats.start_ns) / 1e9,
+                    (unsigned long long)stats.connections_accepted, (unsigned long long)stats.connections_closed,
+                    (unsigned long long)stats.timer_runs);
+    length = append_histogram(text, size, length, stats.timer_hist);
+    for (c = 0; c < 256; c++) {
+        s = &stats.commands[c];
+        if (s->requests == 0 && s->invalid == 0 && s->bytes_out == 0)
+            continue;
+        length = append_command(text, size, length, c);
+        length = append(text, size, length,
+                        " requests %llu invalid %llu bytes_in %llu bytes_out %llu service_us %.1f bus_us %.1f\n",
+                        (unsigned long long)s->requests, (unsigned long long)s->invalid,
+                        (unsigned long long)s->bytes_in, (unsigned long long)s->bytes_out,
+                        s->service_ns / 1e3, s->bus_ns / 1e3);
+        length = append_command(text, size, length, c);
+        length = append(text, size, length, " service_hist");
+        length = append_histogram(text, size, length, s->service_hist);
+        length = append_command(text, size, length, c);
+        length = append(text, size, length, " bus_hist");
+        length = append_histogram(text, size, length, s->bus_hist);
+    }
+    return length;
+}
+
+//replaces the file at path with the formatted statistics
+int stats_dump(const char* path) {
+    static char text[65536];
+    char temporary[4096];
+    size_t length = stats_format(text, sizeof(text));
+    FILE* file;
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    file = fopen(temporary, "w");
+    if (file == NULL) return -1;
+    if (fwrite(text, 1, length, file) != length) {
+        fclose(file);
+        return -1;
+    }
+    if (fclose(file) != 0) return -1;
+    return rename(temporary, path);
+}
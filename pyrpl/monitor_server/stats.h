@@ -0,0 +1,84 @@
+/*
+###############################################################################
+#    pyrplockbox - DSP servo controller for quantum optics with the RedPitaya
+#    Copyright (C) 2014-2016  Leonhard Neuhaus  (neuhaus@spectro.jussieu.fr)
+#
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+###############################################################################
+ */
+
+/*
+Instrumentation of the server: per-command counters of requests, invalid
+requests and bytes, and histograms of the service time of the requests and
+of the time spent accessing the FPGA while serving them. Pushed frames count
+towards the bytes sent of their command letter ('p', 'o', 'f', 't'), the
+work done from the timer has a histogram of its own.
+
+Histogram bucket 0 counts durations below 1 us, bucket i durations from
+2^(i-1) to 2^i us, the last bucket everything longer.
+
+The statistics are formatted as text lines of a key and its values:
+    uptime_s SECONDS
+    connections_accepted N
+    connections_closed N
+    timer_runs N
+    timer_hist N0 N1 ...
+    command C requests N invalid N bytes_in N bytes_out N service_us US bus_us US
+    command C service_hist N0 N1 ...
+    command C bus_hist N0 N1 ...
+with the command lines only for commands that were used.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define STATS_BUCKETS 24
+
+struct command_stats {
+    uint64_t requests;
+    uint64_t invalid;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t service_ns;
+    uint64_t bus_ns;
+    uint64_t service_hist[STATS_BUCKETS];
+    uint64_t bus_hist[STATS_BUCKETS];
+};
+
+struct server_stats {
+    uint64_t start_ns;
+    uint64_t connections_accepted;
+    uint64_t connections_closed;
+    uint64_t timer_runs;
+    uint64_t timer_hist[STATS_BUCKETS];
+    struct command_stats commands[256];
+};
+
+extern struct server_stats stats;
+//FPGA access time of the request being served
+extern uint64_t stats_bus_ns;
+
+uint64_t stats_now(void);
+void stats_reset(void);
+void stats_bus(uint64_t start_ns);
+void stats_request(unsigned char command, long bytes_in, uint64_t start_ns);
+void stats_bytes_out(unsigned char command, size_t n);
+void stats_timer(uint64_t start_ns);
+size_t stats_format(char* text, size_t size);
+int stats_dump(const char* path);
+
+#endif
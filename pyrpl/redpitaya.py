@@ -459,7 +459,8 @@ class RedPitaya(object):
 
     def startclient(self):
         self.client = redpitaya_client.MonitorClient(
-            self.parameters['hostname'], self.parameters['port'], restartserver=self.restartserver)
+            self.parameters['hostname'], self.parameters['port'], restartserver=self.restartserver,
+            protocol=2)
         self.makemodules()
         self.logger.debug("Client started successfully. ")
 
@@ -33,13 +33,26 @@ from .pyrpl_utils import time
 CLIENT_NUMBER = 0
 
 
+# maximum number of words of a read or write in protocol version 2
+MAX_TRANSFER = 2**21
+# flag of writes in protocol version 2 that suppresses the answer
+FLAG_NO_ACK = 0x80
+# windows of the spectrum stream, in the order of the server
+SPECTRUM_WINDOWS = ['boxcar', 'hann', 'hamming', 'blackman', 'flattop']
+
+
 class MonitorClient(object):
-    def __init__(self, hostname="192.168.1.0", port=2222, restartserver=None):
+    def __init__(self, hostname="192.168.1.0", port=2222, restartserver=None,
+                 protocol=1):
         """initiates a client connected to monitor_server
 
         hostname: server address, e.g. "localhost" or "192.168.1.0"
         port:    the port that the server is running on. 2222 by default
         restartserver: a function to call that restarts the server in case of problems
+        protocol: 2 to use request ids, 32-bit lengths, writes without
+                  acknowledgement and the single-request scope data. The
+                  client falls back to version 1 if the server does not
+                  support it.
         """
         self.logger = logging.getLogger(name=__name__)
         # update global client counter and assign a number to this client
@@ -53,6 +66,9 @@ class MonitorClient(object):
         self._port = port
         self._read_counter = 0 # For debugging and unittests
         self._write_counter = 0 # For debugging and unittests
+        self._protocol = protocol
+        self._version = 1
+        self._request_id = 0
         self.socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         # try to connect at least 5 times
         for i in range(5):
@@ -77,11 +93,58 @@ class MonitorClient(object):
             else:
                 break
         self.socket.settimeout(1.0)  # 1 second timeout for socket operations
+        if protocol > 1:
+            self._negotiate(protocol)
+
+    def _negotiate(self, version):
+        # servers that do not know 'v' ignore it like any request of length
+        # 0, so a read sent right after a 'v' for version 1 tells whether
+        # the server answered it
+        self.socket.sendall(b'v' + bytes(bytearray([1, 0, 0, 0, 0, 0, 0]))
+                            + self._header(b'r', 0, 1, 0x40000000))
+        answer = self._recv_exactly(8)
+        if answer[:1] == b'r':
+            self._recv_exactly(4)
+            self.logger.debug("Server does not know protocol versions, "
+                              "using protocol version 1")
+            return
+        if answer[:1] != b'v' or self._recv_exactly(12)[:1] != b'r':
+            raise socket.error("Protocol negotiation failed")
+        header = b'v' + bytes(bytearray([version, 0, 0, 0, 0, 0, 0]))
+        self.socket.send(header)
+        answer = self._recv_exactly(8)
+        if answer[:1] != b'v':
+            raise socket.error("Protocol negotiation failed")
+        self._version = bytearray(answer)[1]
+        self.logger.debug("Using protocol version %d", self._version)
+
+    def _header(self, command, flags, length, addr):
+        """returns a request header in the negotiated format"""
+        if self._version >= 2:
+            self._request_id = (self._request_id + 1) & 0xFFFFFFFF
+            return command + bytes(bytearray([flags, 0, 0])) + \
+                np.array([self._request_id, length, addr], dtype=np.uint32).tobytes()
+        return command + bytes(bytearray([flags,
+                                          length & 0xFF, (length >> 8) & 0xFF,
+                                          addr & 0xFF, (addr >> 8) & 0xFF,
+                                          (addr >> 16) & 0xFF, (addr >> 24) & 0xFF]))
+
+    @property
+    def _header_size(self):
+        return 16 if self._version >= 2 else 8
+
+    def _header_fields(self, header):
+        """returns (length, address) of a header in the negotiated format"""
+        header = bytearray(header)
+        if self._version >= 2:
+            _, length, addr = np.frombuffer(header[4:16], dtype=np.uint32)
+            return int(length), int(addr)
+        return header[2] + (header[3] << 8), \
+            int(np.frombuffer(header[4:8], dtype=np.uint32)[0])
 
     def close(self):
         try:
-            self.socket.send(
-                b'c' + bytes(bytearray([0, 0, 0, 0, 0, 0, 0])))
+            self.socket.send(self._header(b'c', 0, 0, 0))
             self.socket.close()
         except socket.error:
             return
@@ -96,51 +159,449 @@ class MonitorClient(object):
             sine(440, 0.05)
         return self.try_n_times(self._reads, addr, length)
 
-    def writes(self, addr, values):
+    def writes(self, addr, values, ack=True):
+        """writes values to consecutive words starting at addr
+
+        ack: wait for the server to confirm the write. With protocol
+             version 2, ack=False returns right after sending, such that
+             many writes can be sent back to back. Any later request that is
+             answered confirms the write.
+        """
         self._write_counter += 1
         if hasattr(self, '_sound_debug') and self._sound_debug:
             sine(880, 0.05)
+        if not ack and self._version >= 2:
+            return self.try_n_times(self._writes_no_ack, addr, values)
         return self.try_n_times(self._writes, addr, values)
-    
+
+    def batch(self, operations):
+        """executes a list of reads and writes in a single round trip
+
+        operations: list of tuples ('r', addr, length) or ('w', addr, values)
+        returns the list of arrays read, in the order of the 'r' operations
+        """
+        self._read_counter += 1
+        return self.try_n_times(self._batch, 0, operations)
+
+    def masked_write(self, addr, masks, values):
+        """sets the bits selected by masks of the words at addr to values in a
+        single round trip, leaving the other bits unchanged
+
+        masks, values: one mask and value per word, starting at addr
+        """
+        self._write_counter += 1
+        return self.try_n_times(self._masked_write, addr, (masks, values))
+
+    def scope_data(self, length, packed=True):
+        """returns the first length samples of both scope channel buffers
+
+        packed: transfer only the lower 16 bits of each sample
+
+        Both channels come in a single request only after protocol version
+        2 was negotiated, since older servers exit on unknown requests.
+        Otherwise, they are read one after the other.
+        """
+        self._read_counter += 1
+        if self._version < 2:
+            data = np.array([self.try_n_times(self._reads, 0x40110000, length),
+                             self.try_n_times(self._reads, 0x40120000, length)])
+            return data.astype(np.uint16) if packed else data
+        return self.try_n_times(self._scope_data, length, packed)
+
+    def average_traces(self, n_traces, points=2**14, channels=(1, 2),
+                       envelope=False, trigger_source=1, timeout=None):
+        """acquires n_traces scope traces and averages them on the board
+
+        The scope must be configured for a single acquisition (decimation,
+        trigger delay, thresholds) and is armed by the server for each trace.
+        points:         points per channel, must divide 2**14, each point is
+                        the mean of 2**14 / points consecutive samples
+        channels:       the scope channels to average
+        envelope:       also return the smallest and largest sample of each point
+        trigger_source: value of the scope trigger source register
+        timeout:        maximum time in seconds to wait for all traces,
+                        None waits as long as it takes
+
+        returns (n, mean, minima, maxima) where n is the number of averaged
+        traces and the arrays have one row per channel, in ADC units.
+        minima and maxima are None without envelope.
+        """
+        self._read_counter += 1
+        return self._average_traces(n_traces, points, channels, envelope,
+                                    trigger_source, timeout)
+
+    def stats(self, reset=False):
+        """returns the statistics of the server as a dict
+
+        Keys are the counters of the server (uptime_s, connections_accepted,
+        connections_closed, timer_runs), timer_hist, and 'commands', a dict
+        with the counters and histograms of every used command letter.
+        Histogram bucket 0 counts durations below 1 us, bucket i durations
+        from 2**(i-1) to 2**i us.
+        reset: restart all counters after reading them
+        """
+        self._read_counter += 1
+        return self.try_n_times(self._stats, 0, reset)
+
+    def snapshot(self):
+        """returns the configuration registers of all modules as one array
+
+        The first word identifies the register layout of the server, the
+        others are the register values. Pass the array to restore() to
+        return to this configuration.
+        """
+        self._read_counter += 1
+        return self.try_n_times(self._snapshot, 0, None)
+
+    def restore(self, snapshot):
+        """writes the configuration registers of a snapshot()
+
+        Only the registers that differ from the current configuration are
+        written, all in a single round trip. Returns the number of words
+        written.
+        """
+        self._write_counter += 1
+        return self.try_n_times(self._restore, 0, snapshot)
+
     # the actual code
     def _reads(self, addr, length):
-        if length > 65535:
-            length = 65535
+        maximum = MAX_TRANSFER if self._version >= 2 else 65535
+        if length > maximum:
+            length = maximum
             self.logger.warning("Maximum read-length is %d", length)
-        header = b'r' + bytes(bytearray([0,
-                                         length & 0xFF, (length >> 8) & 0xFF,
-                                         addr & 0xFF, (addr >> 8) & 0xFF, (addr >> 16) & 0xFF, (addr >> 24) & 0xFF]))
+        header = self._header(b'r', 0, length, addr)
+        size = len(header)
         self.socket.send(header)
-        data = self.socket.recv(length * 4 + 8)
-        while (len(data) < length * 4 + 8):
-            data += self.socket.recv(length * 4 - len(data) + 8)
-        if data[:8] == header:  # check for in-sync transmission
-            return np.frombuffer(data[8:], dtype=np.uint32)
+        data = self._recv_exactly(length * 4 + size)
+        if data[:size] == header:  # check for in-sync transmission
+            return np.frombuffer(data[size:], dtype=np.uint32)
         else:  # error handling
             self.logger.error("Wrong control sequence from server: %s", data[:8])
             self.emptybuffer()
             return None
 
     def _writes(self, addr, values):
-        values = values[:65535 - 2]
-        length = len(values)
-        header = b'w' + bytes(bytearray([0,
-                                         length & 0xFF,
-                                         (length >> 8) & 0xFF,
-                                         addr & 0xFF,
-                                         (addr >> 8) & 0xFF,
-                                         (addr >> 16) & 0xFF,
-                                         (addr >> 24) & 0xFF]))
+        values = values[:MAX_TRANSFER if self._version >= 2 else 65535 - 2]
+        header = self._header(b'w', 0, len(values), addr)
         # send header+body
-        self.socket.send(header +
-                         np.array(values, dtype=np.uint32).tobytes())
-        if self.socket.recv(8) == header:  # check for in-sync transmission
+        self.socket.sendall(header +
+                            np.array(values, dtype=np.uint32).tobytes())
+        if self._recv_exactly(len(header)) == header:  # check for in-sync transmission
             return True  # indicate successful write
         else:  # error handling
             self.logger.error("Error: wrong control sequence from server")
             self.emptybuffer()
             return None
 
+    def _writes_no_ack(self, addr, values):
+        values = values[:MAX_TRANSFER]
+        header = self._header(b'w', FLAG_NO_ACK, len(values), addr)
+        self.socket.sendall(header +
+                            np.array(values, dtype=np.uint32).tobytes())
+        return True
+
+    def _masked_write(self, addr, masks_values):
+        masks, values = masks_values
+        pairs = np.array([masks, values], dtype=np.uint32).T[:65535]
+        header = self._header(b'm', 0, len(pairs), addr)
+        self.socket.sendall(header + pairs.tobytes())
+        if self._recv_exactly(len(header)) == header:  # check for in-sync transmission
+            return True
+        else:  # error handling
+            self.logger.error("Error: wrong control sequence from server")
+            self.emptybuffer()
+            return None
+
+    def _batch(self, addr, operations):
+        if len(operations) > 4096:
+            raise ValueError("Maximum batch length is 4096")
+        entries, data, lengths = b'', b'', []
+        for op, address, arg in operations:
+            if op == 'r':
+                length = arg
+                lengths.append(length)
+            else:
+                length = len(arg)
+                data += np.array(arg, dtype=np.uint32).tobytes()
+            entries += op.encode() + bytes(bytearray([0,
+                                          length & 0xFF, (length >> 8) & 0xFF,
+                                          address & 0xFF, (address >> 8) & 0xFF,
+                                          (address >> 16) & 0xFF, (address >> 24) & 0xFF]))
+        header = self._header(b'b', 0, len(operations), 0)
+        size = len(header)
+        self.socket.sendall(header + entries + data)
+        data = self._recv_exactly(sum(lengths) * 4 + size)
+        if data[:size] != header:  # check for in-sync transmission
+            self.logger.error("Wrong control sequence from server: %s", data[:size])
+            self.emptybuffer()
+            return None
+        values = np.frombuffer(data[size:], dtype=np.uint32)
+        result, start = [], 0
+        for length in lengths:
+            result.append(values[start:start + length])
+            start += length
+        return result
+
+    def _stats(self, addr, reset):
+        header = self._header(b'q', 1 if reset else 0, 0, 0)
+        size = len(header)
+        self.socket.send(header)
+        answer = self._recv_exactly(size)
+        if answer[:1] != b'q':
+            self.logger.error("Wrong control sequence from server: %s", answer)
+            self.emptybuffer()
+            return None
+        length, characters = self._header_fields(answer)
+        text = self._recv_exactly(4 * length)[:characters].decode('ascii')
+        result = {'commands': {}}
+        for line in text.splitlines():
+            fields = line.split()
+            if fields[0] == 'command':
+                command = result['commands'].setdefault(fields[1], {})
+                if fields[2].endswith('_hist'):
+                    command[fields[2]] = np.array(fields[3:], dtype=np.uint64)
+                else:
+                    for key, value in zip(fields[2::2], fields[3::2]):
+                        command[key] = float(value) if '.' in value else int(value)
+            elif fields[0].endswith('_hist'):
+                result[fields[0]] = np.array(fields[1:], dtype=np.uint64)
+            else:
+                result[fields[0]] = float(fields[1]) if '.' in fields[1] else int(fields[1])
+        return result
+
+    def _snapshot(self, addr, value):
+        header = self._header(b'g', 0, 0, 0)
+        size = len(header)
+        self.socket.send(header)
+        answer = self._recv_exactly(size)
+        if answer[:1] != b'g':
+            self.logger.error("Wrong control sequence from server: %s", answer)
+            self.emptybuffer()
+            return None
+        length, layout = self._header_fields(answer)
+        values = np.frombuffer(self._recv_exactly(4 * length), dtype=np.uint32)
+        return np.concatenate(([layout], values)).astype(np.uint32)
+
+    def _restore(self, addr, snapshot):
+        snapshot = np.asarray(snapshot, dtype=np.uint32)
+        header = self._header(b'l', 0, len(snapshot) - 1, int(snapshot[0]))
+        self.socket.sendall(header + snapshot[1:].tobytes())
+        answer = self._recv_exactly(len(header))
+        if answer[:1] != b'l':
+            self.logger.error("Wrong control sequence from server: %s", answer)
+            self.emptybuffer()
+            return None
+        return self._header_fields(answer)[1]
+
+    def _scope_data(self, length, packed):
+        if length > 2**14:
+            raise ValueError("Maximum scope data length is %d" % 2**14)
+        header = self._header(b'a', 1 if packed else 0, length, 0)
+        size = len(header)
+        self.socket.send(header)
+        data = self._recv_exactly(length * (4 if packed else 8) + size)
+        if data[:size] != header:  # check for in-sync transmission
+            self.logger.error("Wrong control sequence from server: %s", data[:size])
+            self.emptybuffer()
+            return None
+        dtype = np.uint16 if packed else np.uint32
+        return np.frombuffer(data[size:], dtype=dtype).reshape(2, length)
+
+    def _average_traces(self, n_traces, points, channels, envelope,
+                        trigger_source, timeout):
+        if points < 1 or 2**14 % points != 0:
+            raise ValueError("The number of points must divide %d" % 2**14)
+        if n_traces > (2**32 - 1 if self._version >= 2 else 2**16 - 1):
+            raise ValueError("Too many traces for protocol version %d" % self._version)
+        flags = (1 if envelope else 0) | (2 if 1 in channels else 0) \
+                | (4 if 2 in channels else 0)
+        n_channels = 2 if len(set(channels)) != 1 else 1
+        header = self._header(b't', flags, n_traces,
+                              (points & 0xFFFF) | (trigger_source << 16))
+        size = len(header)
+        self.socket.send(header)
+        # the answer only comes when all traces are acquired
+        self.socket.settimeout(timeout)
+        try:
+            answer = self._recv_exactly(size)
+        finally:
+            self.socket.settimeout(1.0)
+        if answer[:1] != b't':
+            self.logger.error("Wrong control sequence from server: %s", answer)
+            self.emptybuffer()
+            return None
+        length, n = self._header_fields(answer)
+        sums = np.frombuffer(self._recv_exactly(8 * n_channels * points),
+                             dtype=np.int64).reshape(n_channels, points)
+        mean = sums / float(max(n, 1) * (2**14 // points))
+        if not envelope:
+            return n, mean, None, None
+        envelopes = np.frombuffer(self._recv_exactly(8 * n_channels * points),
+                                  dtype=np.int32).reshape(n_channels, 2, points)
+        return n, mean, envelopes[:, 0], envelopes[:, 1]
+
+    def subscribe(self, ranges, period=1e-3, on_change=False):
+        """makes the server push the values of the address ranges periodically
+
+        ranges:    list of tuples (addr, length)
+        period:    sampling period in seconds
+        on_change: only push samples that differ from the previous one
+
+        Answers to other commands are interleaved with the pushed frames,
+        so a dedicated client should be used for subscriptions.
+        """
+        period_us = int(round(period * 1e6))
+        header = self._header(b's', 1 if on_change else 0, len(ranges), period_us)
+        entries = b''
+        for addr, length in ranges:
+            entries += b'r' + bytes(bytearray([0,
+                                    length & 0xFF, (length >> 8) & 0xFF,
+                                    addr & 0xFF, (addr >> 8) & 0xFF,
+                                    (addr >> 16) & 0xFF, (addr >> 24) & 0xFF]))
+        self._subscribed_lengths = [length for addr, length in ranges]
+        self.socket.send(header + entries)
+        if self._recv_exactly(len(header)) != header:
+            self.logger.error("Error: wrong control sequence from server")
+            self.emptybuffer()
+            return None
+        return True
+
+    def receive_sample(self):
+        """returns the next pushed sample as (sample_number, list of arrays)"""
+        header = self._recv_exactly(self._header_size)
+        if header[:1] != b'p':
+            self.logger.error("Wrong control sequence from server: %s", header)
+            return None
+        length, sample_number = self._header_fields(header)
+        values = np.frombuffer(self._recv_exactly(length * 4), dtype=np.uint32)
+        result, start = [], 0
+        for length in self._subscribed_lengths:
+            result.append(values[start:start + length])
+            start += length
+        return sample_number, result
+
+    def start_scope_stream(self, period=1e-3, channels=(1, 2), packed=True):
+        """makes the server stream all new scope samples without gaps
+
+        The scope must be running continuously (rolling mode).
+        period:   polling period of the scope write pointer in seconds
+        channels: the scope channels to stream
+        packed:   transfer only the lower 16 bits of each sample
+        """
+        period_us = int(round(period * 1e6))
+        flags = (1 if packed else 0) | (2 if 1 in channels else 0) \
+                | (4 if 2 in channels else 0)
+        header = self._header(b'o', flags, 0, period_us)
+        self._scope_stream_format = (2 if len(set(channels)) != 1 else 1,
+                                     np.uint16 if packed else np.uint32)
+        self.socket.send(header)
+        if self._recv_exactly(len(header)) != header:
+            self.logger.error("Error: wrong control sequence from server")
+            self.emptybuffer()
+            return None
+        return True
+
+    def receive_scope_segment(self):
+        """returns the next streamed scope segment
+
+        returns (frame_number, first_sample_index, overflows, data) where
+        data has one row per streamed channel
+        """
+        header = self._recv_exactly(self._header_size)
+        if header[:1] != b'o':
+            self.logger.error("Wrong control sequence from server: %s", header)
+            return None
+        length, frame_number = self._header_fields(header)
+        info = np.frombuffer(self._recv_exactly(12), dtype=np.uint32)
+        n_channels, dtype = self._scope_stream_format
+        data = self._recv_exactly(self._scope_segment_bytes(header))
+        data = np.frombuffer(data, dtype=dtype)[:n_channels * length]
+        return (frame_number, int(info[0]) + (int(info[1]) << 32), info[2],
+                data.reshape(n_channels, -1))
+
+    def _scope_segment_bytes(self, header):
+        n_channels, dtype = self._scope_stream_format
+        size = n_channels * self._header_fields(header)[0] * np.dtype(dtype).itemsize
+        return (size + 3) & ~3
+
+    def start_spectrum_stream(self, segment_length=4096, n_average=16,
+                              window='hann', channels=(1, 2), period=1e-3):
+        """makes the server push Welch power spectra of the running scope
+
+        The scope must be running continuously (rolling mode).
+        segment_length: FFT length, a power of 2 from 2**6 to 2**14
+        n_average:      number of half-overlapping segments per spectrum
+        window:         one of SPECTRUM_WINDOWS
+        channels:       the scope channels to analyze
+        period:         polling period of the scope write pointer in seconds
+        """
+        log2_length = int(np.log2(segment_length))
+        if 2**log2_length != segment_length or not 6 <= log2_length <= 14:
+            raise ValueError("The segment length must be a power of 2 "
+                             "from 2**6 to 2**14")
+        if n_average < 1:
+            raise ValueError("At least one segment must be averaged")
+        period_us = int(round(period * 1e6))
+        flags = (2 if 1 in channels else 0) | (4 if 2 in channels else 0)
+        header = self._header(b'f', flags, n_average,
+                              log2_length | (SPECTRUM_WINDOWS.index(window) << 4)
+                              | (period_us << 8))
+        self._spectrum_channels = 2 if len(set(channels)) != 1 else 1
+        self.socket.send(header)
+        if self._recv_exactly(len(header)) != header:
+            self.logger.error("Error: wrong control sequence from server")
+            self.emptybuffer()
+            return None
+        return True
+
+    def receive_spectrum(self):
+        """returns the next pushed spectrum
+
+        returns (spectrum_number, lost, power) where power has one row of
+        segment_length/2 + 1 bins per channel, in squared ADC units per bin,
+        i.e. the power spectral density times the sampling rate, and lost
+        tells whether samples were lost since the previous spectrum
+        """
+        header = self._recv_exactly(self._header_size)
+        if header[:1] != b'f':
+            self.logger.error("Wrong control sequence from server: %s", header)
+            return None
+        length, spectrum_number = self._header_fields(header)
+        power = np.frombuffer(
+            self._recv_exactly(4 * self._spectrum_channels * length),
+            dtype=np.float32)
+        return (spectrum_number, bool(bytearray(header)[1] & 0x1),
+                power.reshape(self._spectrum_channels, length))
+
+    def unsubscribe(self):
+        """stops pushed samples, scope and spectrum streams and discards the frames still in transit"""
+        header = self._header(b'u', 0, 0, 0)
+        self.socket.send(header)
+        while True:
+            data = self._recv_exactly(len(header))
+            if data == header:
+                return True
+            if data[:1] == b'p':
+                self._recv_exactly(self._header_fields(data)[0] * 4)
+            elif data[:1] == b'o':
+                self._recv_exactly(12 + self._scope_segment_bytes(data))
+            elif data[:1] == b'f':
+                self._recv_exactly(4 * self._spectrum_channels
+                                   * self._header_fields(data)[0])
+            else:
+                self.logger.error("Wrong control sequence from server: %s", data)
+                self.emptybuffer()
+                return None
+
+    def _recv_exactly(self, length):
+        data = b''
+        while (len(data) < length):
+            chunk = self.socket.recv(length - len(data))
+            if not chunk:
+                raise socket.error("Connection closed by server")
+            data += chunk
+        return data
+
     def emptybuffer(self):
         for i in range(100):
             n = len(self.socket.recv(16384))
@@ -173,7 +634,8 @@ class MonitorClient(object):
         self.__init__(
             hostname=self._hostname,
             port=port,
-            restartserver=self._restartserver)
+            restartserver=self._restartserver,
+            protocol=self._protocol)
 
 
 class DummyClient(object):  # pragma: no cover
@@ -259,9 +721,48 @@ class DummyClient(object):  # pragma: no cover
             val.append(self.read_fpgamemory(addr+0x4*i))
         return np.array(val, dtype=np.uint32)
     
-    def writes(self, addr, values): # pragma: no-cover
+    def writes(self, addr, values, ack=True): # pragma: no-cover
         for i, v in enumerate(values):
             self.fpgamemory[str(addr+0x4*i)]=v
+
+    def masked_write(self, addr, masks, values):
+        for i, (mask, value) in enumerate(zip(masks, values)):
+            old = int(self.read_fpgamemory(addr + 0x4 * i))
+            self.writes(addr + 0x4 * i, [(old & ~mask) | (value & mask)])
+        return True
+
+    def scope_data(self, length, packed=True):
+        dtype = np.uint16 if packed else np.uint32
+        return np.array([self.reads(0x40110000, length),
+                         self.reads(0x40120000, length)], dtype=dtype)
+
+    def average_traces(self, n_traces, points=2**14, channels=(1, 2),
+                       envelope=False, trigger_source=1, timeout=None):
+        data = self.scope_data(2**14, packed=False).astype(np.int64) & 0x3FFF
+        data[data >= 2**13] -= 2**14
+        data = data[[ch - 1 for ch in sorted(set(channels))]]
+        bins = data.reshape(len(data), points, -1)
+        if not envelope:
+            return n_traces, bins.mean(axis=2), None, None
+        return n_traces, bins.mean(axis=2), bins.min(axis=2), bins.max(axis=2)
+
+    def stats(self, reset=False):
+        return {'commands': {}}
+
+    def snapshot(self):
+        return np.array([0], dtype=np.uint32)
+
+    def restore(self, snapshot):
+        return 0
+
+    def batch(self, operations):
+        result = []
+        for op, addr, arg in operations:
+            if op == 'r':
+                result.append(self.reads(addr, arg))
+            else:
+                self.writes(addr, arg)
+        return result
     
     def restart(self):
         pass
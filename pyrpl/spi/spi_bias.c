@@ -0,0 +1,167 @@
+/* @brief Bias DAC packets and batched SPI writes, see spi_bias.h
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <string.h>
+#include <linux/spi/spidev.h>
+#include <linux/types.h>
+
+#include "spi_bias.h"
+
+/* packet.address is the channel number for which to set the bias voltage, and package.value is the voltage up to the maximum =1023 */
+bool is_spi_packet_valid(spi_packet spi_packet){
+    if(spi_packet.address < 0 || spi_packet.address >= SPI_N_CHANNELS){
+        return false;
+    }
+    if(spi_packet.value < 0 || spi_packet.value > SPI_MAX_VALUE){
+        return false;
+    }
+    return true;
+}
+
+/* Encodes the packet into the SPI_PACKET_SIZE bytes at result */
+void spi_packet_encode(spi_packet spi_packet, unsigned char *result){
+
+    /* Extract the address and value into four and ten bits respectively */
+    int address_4bits = spi_packet.address & 0xF;
+    int value_10bits = spi_packet.value & 0x3FF;
+
+    /* Build the char */
+    result[0] = (address_4bits << 4) | ((value_10bits >> 6) & 0xF);
+    result[1] = ((value_10bits & 0x3F) << 2) | 0b01;
+}
+
+int open_bias_device(const char *path, int speed, bias_device *device){
+    int mode = 0;
+
+    device->spidev = true;
+    device->fd = open(path, O_RDWR | O_NOCTTY);
+    if(device->fd < 0){
+        fprintf(stderr, "Error opening %s. Error: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    /* Setting mode (CPHA, CPOL), which only a spidev device understands */
+    if(ioctl(device->fd, SPI_IOC_WR_MODE, &mode) < 0){
+        if(errno == ENOTTY){
+            device->spidev = false;
+            return 0;
+        }
+        fprintf(stderr, "Error setting SPI_IOC_WR_MODE. Error: %s\n", strerror(errno));
+        close_bias_device(device);
+        return -1;
+    }
+
+    /* Setting SPI bus speed */
+    if(ioctl(device->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0){
+        fprintf(stderr, "Error setting SPI_IOC_WR_MAX_SPEED_HZ. Error: %s\n", strerror(errno));
+        close_bias_device(device);
+        return -1;
+    }
+
+    return 0;
+}
+
+void close_bias_device(bias_device *device){
+    if(device->fd >= 0){
+        close(device->fd);
+        device->fd = -1;
+    }
+}
+
+int write_bias_values(bias_device *device, const int *value, int *state, unsigned char *rx){
+    struct spi_ioc_transfer xfer[SPI_N_CHANNELS];
+    unsigned char tx[SPI_N_CHANNELS][SPI_PACKET_SIZE];
+    int channel[SPI_N_CHANNELS];
+    int n = 0;
+
+    memset(xfer, 0, sizeof xfer);
+    for(int i = 0; i < SPI_N_CHANNELS; i++){
+        if(value[i] < 0 || value[i] == state[i]){
+            continue;
+        }
+        spi_packet_encode((spi_packet){ .address = i, .value = value[i] }, tx[n]);
+        xfer[n].tx_buf = (__u64)(uintptr_t)tx[n];
+        xfer[n].rx_buf = rx != NULL ? (__u64)(uintptr_t)(rx + n * SPI_PACKET_SIZE) : 0;
+        xfer[n].len = SPI_PACKET_SIZE;
+        /* deselect the DAC after every word, such that it latches the value */
+        xfer[n].cs_change = 1;
+        channel[n] = i;
+        n++;
+    }
+    if(n == 0){
+        return 0;
+    }
+    /* on the last transfer cs_change would keep the chip selected */
+    xfer[n - 1].cs_change = 0;
+
+    if(device->spidev){
+        if(ioctl(device->fd, SPI_IOC_MESSAGE(n), xfer) < 0){
+            perror("SPI_IOC_MESSAGE");
+            return -1;
+        }
+    } else {
+        /* tx is contiguous, so the stand-in gets all words at once */
+        if(write(device->fd, tx, n * SPI_PACKET_SIZE) != n * SPI_PACKET_SIZE){
+            perror("Failed to write to SPI");
+            return -1;
+        }
+        if(rx != NULL){
+            memset(rx, 0, n * SPI_PACKET_SIZE);
+        }
+    }
+
+    for(int i = 0; i < n; i++){
+        state[channel[i]] = value[channel[i]];
+    }
+    return n;
+}
+
+void read_bias_state(const char *filename, int *state){
+    int address, value;
+    FILE *file;
+
+    for(int i = 0; i < SPI_N_CHANNELS; i++){
+        state[i] = -1;
+    }
+    if(filename == NULL || (file = fopen(filename, "r")) == NULL){
+        return;
+    }
+    /* invalid lines are ignored, such that their channels are sent again */
+    while(fscanf(file, "%d\t%d\n", &address, &value) == 2){
+        if(is_spi_packet_valid((spi_packet){ .address = address, .value = value })){
+            state[address] = value;
+        }
+    }
+    fclose(file);
+}
+
+/* Replaces the state file, such that it is never left half written */
+int write_bias_state(const char *filename, const int *state){
+    char tmp_filename[1024];
+    FILE *file;
+
+    snprintf(tmp_filename, sizeof tmp_filename, "%s.tmp", filename);
+    if((file = fopen(tmp_filename, "w")) == NULL){
+        perror("Error writing state file");
+        return -1;
+    }
+    for(int i = 0; i < SPI_N_CHANNELS; i++){
+        if(state[i] >= 0){
+            fprintf(file, "%d\t%d\n", i, state[i]);
+        }
+    }
+    fclose(file);
+    if(rename(tmp_filename, filename) < 0){
+        perror("Error writing state file");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,50 @@
+/* @brief Bias DAC packets and batched SPI writes, shared by spi_test, spi_biasd and spi_ramp
+*
+* The DAC takes one 16 bit word per channel: four address bits, ten value bits
+* and two trailing bits 0b01. A batch of values is sent as a single
+* SPI_IOC_MESSAGE with one transfer per channel and the chip select released
+* in between. Any other file (e.g. a regular file or FIFO standing in for the
+* device) gets the same words with a single write().
+*/
+
+#ifndef SPI_BIAS_H
+#define SPI_BIAS_H
+
+#include <stdbool.h>
+
+#define SPI_PACKET_SIZE 2
+#define SPI_N_CHANNELS 16
+#define SPI_MAX_VALUE 1023
+#define SPI_DEFAULT_DEVICE "/dev/spidev1.0"
+#define SPI_DEFAULT_SPEED 1000000
+
+typedef struct spi_packet_s{
+    int address;
+    int value;
+} spi_packet;
+
+typedef struct bias_device_s{
+    int fd;
+    /* false for a stand-in file, which is written instead of using ioctl */
+    bool spidev;
+} bias_device;
+
+/* true if the address is a channel of the DAC and the value is in 0..SPI_MAX_VALUE */
+bool is_spi_packet_valid(spi_packet spi_packet);
+void spi_packet_encode(spi_packet spi_packet, unsigned char *result);
+
+int open_bias_device(const char *path, int speed, bias_device *device);
+void close_bias_device(bias_device *device);
+
+/* Sends value[i] to every channel i with value[i] >= 0 and value[i] != state[i], and
+ * updates state. rx (SPI_N_CHANNELS * SPI_PACKET_SIZE bytes, may be NULL) receives
+ * what the DAC returned, in the order of the channels sent. Returns the number of
+ * channels sent, or -1. */
+int write_bias_values(bias_device *device, const int *value, int *state, unsigned char *rx);
+
+/* The state file holds the last applied value of every channel, one "channel<TAB>value"
+ * line each. Channels that were never written are -1. */
+void read_bias_state(const char *filename, int *state);
+int write_bias_state(const char *filename, const int *state);
+
+#endif
@@ -0,0 +1,264 @@
+/* @brief Resident daemon that keeps the bias DAC open and applies updates received over a Unix socket
+*
+* Usage: spi_biasd [-d DEVICE] [-S SPEED_HZ] [-s STATE_FILE] [SOCKET]
+*
+* Clients send text lines and get one reply line per request:
+*   set CH VALUE [CH VALUE ...]   applies all values with a single SPI message,
+*                                 replies "ok N" with the number of channels sent
+*                                 (channels that already have their value are skipped)
+*   get                           replies "ok" followed by "CH VALUE" for every known channel
+*   reset                         forgets the known values, such that the next set sends them all
+* Errors are replied as "error MESSAGE".
+*
+* DEVICE can be any file instead of the spidev device, e.g. a FIFO, which then receives
+* the DAC words (see spi_bias.h).
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "spi_bias.h"
+
+#define DEFAULT_SOCKET "/tmp/spi_biasd.sock"
+#define MAX_CLIENTS 16
+#define MAX_LINE 1024
+#define MAX_REPLY 512
+
+typedef struct client_s{
+    int fd;
+    char in[MAX_LINE];
+    int used;
+} client;
+
+static bias_device device = { .fd = -1 };
+static int state[SPI_N_CHANNELS];
+static const char *state_filename = NULL;
+static client clients[MAX_CLIENTS];
+static volatile sig_atomic_t running = 1;
+
+static void stop(int signum){
+    running = 0;
+}
+
+static void send_reply(client *c, const char *reply){
+    if(send(c->fd, reply, strlen(reply), MSG_NOSIGNAL) < 0){
+        perror("Failed to send reply");
+    }
+}
+
+static void handle_set(client *c, char *args){
+    int value[SPI_N_CHANNELS];
+    int channel, v, n, consumed;
+    char reply[MAX_REPLY];
+
+    for(int i = 0; i < SPI_N_CHANNELS; i++){
+        value[i] = -1;
+    }
+    while(sscanf(args, "%d %d%n", &channel, &v, &consumed) == 2){
+        if(!is_spi_packet_valid((spi_packet){ .address = channel, .value = v })){
+            snprintf(reply, sizeof reply, "error invalid value %d for channel %d\n", v, channel);
+            send_reply(c, reply);
+            return;
+        }
+        value[channel] = v;
+        args += consumed;
+    }
+    while(*args == ' ' || *args == '\t'){
+        args++;
+    }
+    if(*args != '\0'){
+        send_reply(c, "error expected pairs of channel and value\n");
+        return;
+    }
+
+    n = write_bias_values(&device, value, state, NULL);
+    if(n < 0){
+        snprintf(reply, sizeof reply, "error %s\n", strerror(errno));
+        send_reply(c, reply);
+        return;
+    }
+    snprintf(reply, sizeof reply, "ok %d\n", n);
+    send_reply(c, reply);
+    /* the client already has its answer, so the state file does not add to the latency */
+    if(n > 0 && state_filename != NULL){
+        write_bias_state(state_filename, state);
+    }
+}
+
+static void handle_line(client *c, char *line){
+    char reply[MAX_REPLY];
+    int length;
+
+    if(strncmp(line, "set ", 4) == 0){
+        handle_set(c, line + 4);
+    } else if(strcmp(line, "get") == 0){
+        length = snprintf(reply, sizeof reply, "ok");
+        for(int i = 0; i < SPI_N_CHANNELS; i++){
+            if(state[i] >= 0){
+                length += snprintf(reply + length, sizeof reply - length, " %d %d", i, state[i]);
+            }
+        }
+        snprintf(reply + length, sizeof reply - length, "\n");
+        send_reply(c, reply);
+    } else if(strcmp(line, "reset") == 0){
+        for(int i = 0; i < SPI_N_CHANNELS; i++){
+            state[i] = -1;
+        }
+        send_reply(c, "ok\n");
+    } else {
+        send_reply(c, "error unknown command\n");
+    }
+}
+
+/* reads what the client sent and handles every complete line, returns -1 if the client is gone */
+static int receive(client *c){
+    char *line, *end;
+    int received = recv(c->fd, c->in + c->used, sizeof c->in - c->used - 1, 0);
+
+    if(received <= 0){
+        return -1;
+    }
+    c->used += received;
+    c->in[c->used] = '\0';
+
+    line = c->in;
+    while((end = strchr(line, '\n')) != NULL){
+        *end = '\0';
+        if(end > line && end[-1] == '\r'){
+            end[-1] = '\0';
+        }
+        handle_line(c, line);
+        line = end + 1;
+    }
+    c->used -= line - c->in;
+    memmove(c->in, line, c->used);
+    if(c->used == sizeof c->in - 1){
+        send_reply(c, "error line too long\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *name){
+    fprintf(stderr, "Usage: %s [-d DEVICE] [-S SPEED_HZ] [-s STATE_FILE] [SOCKET]\n"
+                    "  -d  SPI device or stand-in file, default %s\n"
+                    "  -S  SPI clock, default %d Hz\n"
+                    "  -s  keep the values applied to the DAC in STATE_FILE\n"
+                    "  SOCKET defaults to %s\n",
+                    name, SPI_DEFAULT_DEVICE, SPI_DEFAULT_SPEED, DEFAULT_SOCKET);
+    exit(1);
+}
+
+int main(int argc, char **argv){
+    const char *device_path = SPI_DEFAULT_DEVICE;
+    const char *socket_path = DEFAULT_SOCKET;
+    int speed = SPI_DEFAULT_SPEED;
+    struct sockaddr_un addr;
+    struct pollfd fds[MAX_CLIENTS + 1];
+    int listen_fd;
+    int opt;
+
+    while((opt = getopt(argc, argv, "d:S:s:")) != -1){
+        switch(opt){
+        case 'd':
+            device_path = optarg;
+            break;
+        case 'S':
+            speed = atoi(optarg);
+            break;
+        case 's':
+            state_filename = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind < argc){
+        socket_path = argv[optind];
+    }
+
+    if(open_bias_device(device_path, speed, &device) < 0){
+        return -1;
+    }
+    read_bias_state(state_filename, state);
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof addr.sun_path){
+        fprintf(stderr, "Socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0){
+        perror("Error opening socket");
+        return -1;
+    }
+    unlink(socket_path);
+    if(bind(listen_fd, (struct sockaddr *) &addr, sizeof addr) < 0 || listen(listen_fd, MAX_CLIENTS) < 0){
+        perror("Error binding socket");
+        return -1;
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    for(int i = 0; i < MAX_CLIENTS; i++){
+        clients[i].fd = -1;
+    }
+    while(running){
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for(int i = 0; i < MAX_CLIENTS; i++){
+            fds[i + 1].fd = clients[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+        if(poll(fds, MAX_CLIENTS + 1, -1) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        for(int i = 0; i < MAX_CLIENTS; i++){
+            if(clients[i].fd >= 0 && fds[i + 1].revents && receive(&clients[i]) < 0){
+                close(clients[i].fd);
+                clients[i].fd = -1;
+            }
+        }
+        if(fds[0].revents & POLLIN){
+            int fd = accept(listen_fd, NULL, NULL);
+            int i;
+            for(i = 0; fd >= 0 && i < MAX_CLIENTS && clients[i].fd >= 0; i++);
+            if(fd < 0){
+                perror("accept");
+            } else if(i == MAX_CLIENTS){
+                close(fd);
+            } else {
+                clients[i].fd = fd;
+                clients[i].used = 0;
+            }
+        }
+    }
+
+    for(int i = 0; i < MAX_CLIENTS; i++){
+        if(clients[i].fd >= 0){
+            close(clients[i].fd);
+        }
+    }
+    close(listen_fd);
+    unlink(socket_path);
+    close_bias_device(&device);
+    return 0;
+}
@@ -0,0 +1,260 @@
+/* @brief Plays timed bias sequences and ramps on the DAC with absolute deadlines
+*
+* Usage: spi_ramp [-d DEVICE] [-S SPEED_HZ] [-s STATE_FILE] [-n REPEAT] [-r] [-v] SEQUENCE_FILE
+*
+* Every line of SEQUENCE_FILE is either
+*   TIME_US CHANNEL VALUE                 set CHANNEL to VALUE at TIME_US
+*   CHANNEL START STOP STEP DWELL_US      ramp CHANNEL from START to STOP in steps of STEP,
+*                                         holding every value for DWELL_US, starting at time 0
+* Lines starting with # are ignored. All values due at the same time are sent with a single
+* SPI message (see spi_bias.h). The sequence is repeated REPEAT times (0: until interrupted),
+* each repetition starting one step after the last event of the previous one.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "spi_bias.h"
+
+typedef struct event_s{
+    int64_t time_ns;
+    int channel;
+    int value;
+    /* position in the file, such that later lines win at equal times */
+    int order;
+} event;
+
+static event *events = NULL;
+static int n_events = 0;
+static int events_size = 0;
+static volatile sig_atomic_t running = 1;
+
+static void stop(int signum){
+    running = 0;
+}
+
+static void add_event(int64_t time_ns, int channel, int value){
+    if(n_events == events_size){
+        events_size = events_size ? 2 * events_size : 256;
+        events = realloc(events, events_size * sizeof(event));
+        if(events == NULL){
+            perror("Error allocating the sequence");
+            exit(1);
+        }
+    }
+    events[n_events] = (event){ time_ns, channel, value, n_events };
+    n_events++;
+}
+
+static int compare_events(const void *a, const void *b){
+    const event *x = a, *y = b;
+    if(x->time_ns != y->time_ns){
+        return x->time_ns < y->time_ns ? -1 : 1;
+    }
+    return x->order - y->order;
+}
+
+static bool is_valid(int channel, int value){
+    return is_spi_packet_valid((spi_packet){ .address = channel, .value = value });
+}
+
+static int read_sequence(const char *filename){
+    char line[256];
+    double a, b, c, d, e;
+    int line_number = 0;
+    FILE *file = fopen(filename, "r");
+
+    if(file == NULL){
+        perror("Error opening file");
+        return -1;
+    }
+    while(fgets(line, sizeof line, file) != NULL){
+        line_number++;
+        if(line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0'){
+            continue;
+        }
+        int fields = sscanf(line, "%lf %lf %lf %lf %lf", &a, &b, &c, &d, &e);
+        if(fields == 3 && a >= 0 && is_valid(b, c)){
+            add_event(a * 1000, b, c);
+        } else if(fields == 5 && is_valid(a, b) && is_valid(a, c) && d > 0 && e > 0){
+            /* ramp down with a positive step as well */
+            int direction = c >= b ? 1 : -1;
+            int k = 0;
+            for(double value = b; direction * (c - value) > 0; value += direction * d, k++){
+                add_event(k * e * 1000, a, lround(value));
+            }
+            add_event(k * e * 1000, a, c);
+        } else {
+            fprintf(stderr, "Invalid line %d in %s\n", line_number, filename);
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+    qsort(events, n_events, sizeof(event), compare_events);
+    return 0;
+}
+
+static int64_t now_ns(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void sleep_until(int64_t deadline){
+    struct timespec t = { deadline / 1000000000LL, deadline % 1000000000LL };
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR && running);
+}
+
+static void usage(const char *name){
+    fprintf(stderr, "Usage: %s [-d DEVICE] [-S SPEED_HZ] [-s STATE_FILE] [-n REPEAT] [-r] [-v] SEQUENCE_FILE\n"
+                    "  -d  SPI device or stand-in file, default %s\n"
+                    "  -S  SPI clock, default %d Hz\n"
+                    "  -s  skip values the DAC already has according to STATE_FILE, and update it\n"
+                    "  -n  number of repetitions, 0 until interrupted, default 1\n"
+                    "  -r  run with real-time priority\n"
+                    "  -v  print the delay of every step\n",
+                    name, SPI_DEFAULT_DEVICE, SPI_DEFAULT_SPEED);
+    exit(1);
+}
+
+int main(int argc, char **argv){
+    const char *device_path = SPI_DEFAULT_DEVICE;
+    const char *state_filename = NULL;
+    int speed = SPI_DEFAULT_SPEED;
+    long repeat = 1;
+    bool realtime = false;
+    bool verbose = false;
+    bias_device device;
+    int state[SPI_N_CHANNELS];
+    int value[SPI_N_CHANNELS];
+    int64_t start, min_step, period, deadline, late, done;
+    int64_t late_max = 0;
+    double late_sum = 0, late_sum2 = 0, write_sum = 0;
+    long n_steps = 0, n_sent = 0;
+    int opt;
+
+    while((opt = getopt(argc, argv, "d:S:s:n:rv")) != -1){
+        switch(opt){
+        case 'd':
+            device_path = optarg;
+            break;
+        case 'S':
+            speed = atoi(optarg);
+            break;
+        case 's':
+            state_filename = optarg;
+            break;
+        case 'n':
+            repeat = atol(optarg);
+            break;
+        case 'r':
+            realtime = true;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1){
+        usage(argv[0]);
+    }
+    if(read_sequence(argv[optind]) < 0){
+        return -1;
+    }
+    if(n_events == 0){
+        return 0;
+    }
+    /* a repetition takes as long as the sequence plus its shortest step */
+    min_step = 0;
+    for(int i = 1; i < n_events; i++){
+        int64_t step = events[i].time_ns - events[i - 1].time_ns;
+        if(step > 0 && (min_step == 0 || step < min_step)){
+            min_step = step;
+        }
+    }
+    if(min_step == 0 && repeat != 1){
+        fprintf(stderr, "A sequence without steps cannot be repeated\n");
+        return -1;
+    }
+    period = events[n_events - 1].time_ns + min_step;
+
+    if(open_bias_device(device_path, speed, &device) < 0){
+        return -1;
+    }
+    read_bias_state(state_filename, state);
+
+    if(realtime){
+        struct sched_param param;
+        param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+        if(sched_setscheduler(0, SCHED_FIFO, &param) < 0 || mlockall(MCL_CURRENT | MCL_FUTURE) < 0){
+            perror("Error switching to real-time priority");
+            return -1;
+        }
+    }
+    /* the default timer slack of 50 us would be part of every delay */
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    start = now_ns();
+    for(long r = 0; running && (repeat == 0 || r < repeat); r++){
+        for(int i = 0; running && i < n_events; ){
+            deadline = start + r * period + events[i].time_ns;
+            for(int j = 0; j < SPI_N_CHANNELS; j++){
+                value[j] = -1;
+            }
+            for(; i < n_events && start + r * period + events[i].time_ns == deadline; i++){
+                value[events[i].channel] = events[i].value;
+            }
+
+            sleep_until(deadline);
+            late = now_ns() - deadline;
+            int n = write_bias_values(&device, value, state, NULL);
+            if(n < 0){
+                return -1;
+            }
+            done = now_ns() - deadline;
+
+            n_steps++;
+            n_sent += n;
+            late_sum += late;
+            late_sum2 += (double) late * late;
+            write_sum += done - late;
+            if(late > late_max){
+                late_max = late;
+            }
+            if(verbose){
+                printf("%.3f\t%d\t%.3f\t%.3f\n", (deadline - start) / 1e6, n, late / 1e3, done / 1e3);
+            }
+        }
+    }
+
+    if(state_filename != NULL){
+        write_bias_state(state_filename, state);
+    }
+    close_bias_device(&device);
+    if(n_steps > 0){
+        double mean = late_sum / n_steps;
+        fprintf(stderr, "%ld steps, %ld values sent, delay mean %.3f us, std %.3f us, max %.3f us, write %.3f us\n",
+                n_steps, n_sent, mean / 1e3, sqrt(fmax(late_sum2 / n_steps - mean * mean, 0)) / 1e3,
+                late_max / 1e3, write_sum / n_steps / 1e3);
+    }
+    free(events);
+    return 0;
+}
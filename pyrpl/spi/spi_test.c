@@ -20,6 +20,8 @@
 #include <linux/spi/spidev.h>
 #include <linux/types.h>
 
+#include "spi_bias.h"
+
 /* Inline functions definition */
 static int init_spi();
 static int release_spi();
@@ -29,6 +31,8 @@ static int write_spi(char *write_data, int size);
 /* Constants definition */
 int spi_fd = -1;
 
+#define DEFAULT_BIAS_FILE "bias_values.tsv"
+
 // typedef adc_value_s adc_value;
 // struct adc_value_s {
 //     int address;
@@ -43,36 +47,44 @@ int spi_fd = -1;
 //     return true;
 // }
 
-typedef struct spi_packet_s{
-    int address;
-    int value;
-} spi_packet;
+static char *spi_packet_to_char(spi_packet spi_packet){
+    char *result = malloc(SPI_PACKET_SIZE*sizeof(char));
+    spi_packet_encode(spi_packet, (unsigned char *) result);
+    return result;
+}
 
-/* packet.address is the channel number for which to set the bias voltage, and package.value is the voltage up to the maximum =1023 */
-static bool is_spi_packet_valid(spi_packet spi_packet){
-    if(spi_packet.address < 1 || spi_packet.address > 6){
-        return true; 
+/* Sends the last value of every channel in the packets with a single SPI_IOC_MESSAGE.
+ * With verify, the bytes received during the transfers are printed. */
+static int write_spi_batch(const spi_packet *spi_packets, int spi_packet_count, int *state, bool verify){
+    bias_device device = { .fd = spi_fd, .spidev = true };
+    unsigned char rx[SPI_N_CHANNELS * SPI_PACKET_SIZE];
+    unsigned char tx[SPI_PACKET_SIZE];
+    int value[SPI_N_CHANNELS];
+    int old_state[SPI_N_CHANNELS];
+    int n;
+
+    /* later lines for the same channel win */
+    for(int i = 0; i < SPI_N_CHANNELS; i++){
+        value[i] = -1;
     }
-    if(spi_packet.value < 0 || spi_packet.value > 1023){
-        return false;
+    for(int i = 0; i < spi_packet_count; i++){
+        value[spi_packets[i].address & 0xF] = spi_packets[i].value;
     }
-    return true;
-}
-
 
-
-static char *spi_packet_to_char(spi_packet spi_packet){
-    char *result = malloc(2*sizeof(char));
-
-    /* Extract the address and value into four and ten bits respectively */
-    int address_4bits = spi_packet.address & 0xF;
-    int value_10bits = spi_packet.value & 0x3FF;
-
-    /* Build the char */
-    result[0] = (address_4bits << 4) | ((value_10bits >> 6) & 0xF);
-    result[1] = ((value_10bits & 0x3F) << 2) | 0b01;
-
-    return result;
+    memcpy(old_state, state, sizeof old_state);
+    n = write_bias_values(&device, value, state, verify ? rx : NULL);
+    if(verify){
+        for(int i = 0, j = 0; i < SPI_N_CHANNELS && n > 0; i++){
+            if(value[i] < 0 || value[i] == old_state[i]){
+                continue;
+            }
+            spi_packet_encode((spi_packet){ .address = i, .value = value[i] }, tx);
+            printf("Channel %d: sent 0x%02x%02x, received 0x%02x%02x\n",
+                   i, tx[0], tx[1], rx[j * SPI_PACKET_SIZE], rx[j * SPI_PACKET_SIZE + 1]);
+            j++;
+        }
+    }
+    return n;
 }
 
 
@@ -115,7 +127,42 @@ static spi_packet* read_spi_packets_from_file(const char* filename, int *spi_pac
 
 
 
-int main(void){
+static void usage(const char *name){
+    fprintf(stderr, "Usage: %s [-b] [-s STATE_FILE] [-v] [BIAS_FILE]\n"
+                    "  writes the channel<TAB>value lines of BIAS_FILE (default %s) to the DAC\n"
+                    "  -b  send all packets with a single ioctl instead of one write per packet\n"
+                    "  -s  with -b, skip channels that already have their value according to STATE_FILE, and update it\n"
+                    "  -v  with -b, print what was received during the transfers\n",
+                    name, DEFAULT_BIAS_FILE);
+    exit(1);
+}
+
+int main(int argc, char **argv){
+    bool batch = false;
+    bool verify = false;
+    const char *state_filename = NULL;
+    const char *bias_filename = DEFAULT_BIAS_FILE;
+    int state[SPI_N_CHANNELS];
+    int opt;
+
+    while((opt = getopt(argc, argv, "bs:v")) != -1){
+        switch(opt){
+        case 'b':
+            batch = true;
+            break;
+        case 's':
+            state_filename = optarg;
+            break;
+        case 'v':
+            verify = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind < argc){
+        bias_filename = argv[optind];
+    }
 
     /* Sample data */
     // char *data = "0b1001010010001101";
@@ -140,13 +187,26 @@ int main(void){
 
     int spi_packet_count = 0;
     int *spi_packet_count_ptr = &spi_packet_count;
-    spi_packet *spi_packets = read_spi_packets_from_file("bias_values.tsv", spi_packet_count_ptr);
+    spi_packet *spi_packets = read_spi_packets_from_file(bias_filename, spi_packet_count_ptr);
     if(spi_packets == NULL){
         printf("Failed to read spi packets from file!\n");
         return -1;
     }
 
-    for(int i=0; i<spi_packet_count; i++){
+    if(batch){
+        read_bias_state(state_filename, state);
+        int sent = write_spi_batch(spi_packets, spi_packet_count, state, verify);
+        if(sent < 0){
+            printf("Write to SPI failed. Error: %s\n", strerror(errno));
+            return -1;
+        }
+        if(state_filename != NULL && sent > 0 && write_bias_state(state_filename, state) < 0){
+            return -1;
+        }
+        printf("%d channels updated\n", sent);
+    }
+
+    for(int i=0; !batch && i<spi_packet_count; i++){
         char *data = spi_packet_to_char(spi_packets[i]);
 
         /* Write some sample data */
@@ -259,13 +319,13 @@ static int read_flash_id(int fd){
     buf1[2] = 0x45;
 
     /* RDID buffer */
-    xfer[0].tx_buf = (__u64)((__u32)buf0);
-    xfer[0].rx_buf = (__u64)((__u32)buf0);
+    xfer[0].tx_buf = (__u64)(uintptr_t)buf0;
+    xfer[0].rx_buf = (__u64)(uintptr_t)buf0;
     xfer[0].len = 1;
 
     /* Sample loopback buffer */
-    xfer[1].tx_buf = (__u64)((__u32)buf1);
-    xfer[1].rx_buf = (__u64)((__u32)buf1);
+    xfer[1].tx_buf = (__u64)(uintptr_t)buf1;
+    xfer[1].rx_buf = (__u64)(uintptr_t)buf1;
     xfer[1].len = 3;
 
     /* ioctl function arguments